@@ -0,0 +1,178 @@
+#define MAIN
+#include "fmm.h"
+#undef MAIN
+
+// Standalone benchmark of the scalar and the batched rotation operator,
+// followed by the M2L time of rotation against direct translation at this numExpansions,
+// a sweep of the opening angle of the Barnes-Hut treecode against direct summation,
+// the stencil and dual tree FMM against direct summation on particles close to the leaf centers,
+// and the Morton against the Hilbert ordering on uniform and clustered particles
+int main(int argc, char *argv[]){
+  int i,j,je,iteration,numVectors,numParticles,distribution,cluster;
+  double tic,toc,timeScalar,timeBatch,difference,normalizer,timeM2L[2],L2norm;
+  std::complex<double> (*CnmIn)[numCoefficients],(*CnmOut)[numCoefficients],(*CnmOutd)[numCoefficients];
+  vec3<float> *bodyAcceld;
+  FmmKernel kernel;
+  FmmSystem tree;
+
+  maxLevel = 2;
+  numBoxIndexFull = 1 << 3*maxLevel;
+  numBoxIndexLeaf = numBoxIndexFull;
+  numBoxIndexTotal = numBoxIndexFull;
+  rootBoxSize = 2*M_PI;
+  tree.allocate();
+  kernel.precalc();
+
+  numVectors = 1 << 12;
+  CnmIn = new std::complex<double> [numVectors][numCoefficients];
+  CnmOut = new std::complex<double> [numVectors][numCoefficients];
+  CnmOutd = new std::complex<double> [numVectors][numCoefficients];
+  for( i=0; i<numVectors; i++ ) {
+    for( j=0; j<numCoefficients; j++ ) {
+      CnmIn[i][j] = std::complex<double>(rand()/(double) RAND_MAX,rand()/(double) RAND_MAX);
+    }
+  }
+
+  timeScalar = timeBatch = 0;
+  for( iteration=0; iteration<16; iteration++ ) {
+    je = rand()%(2*numRelativeBox);
+    tic = get_time();
+    for( i=0; i<numVectors; i++ ) {
+      kernel.rotation(CnmIn[i],CnmOutd[i],Dnm[je]);
+    }
+    toc = get_time();
+    timeScalar += toc-tic;
+    tic = get_time();
+    kernel.rotationBatch(CnmIn,CnmOut,Dnm[je],numVectors);
+    toc = get_time();
+    timeBatch += toc-tic;
+  }
+
+  difference = normalizer = 0;
+  for( i=0; i<numVectors; i++ ) {
+    for( j=0; j<numCoefficients; j++ ) {
+      difference += norm(CnmOut[i][j]-CnmOutd[i][j]);
+      normalizer += norm(CnmOutd[i][j]);
+    }
+  }
+  printf("scalar : %g ns/vector\n",timeScalar/16/numVectors*1e9);
+  printf("batch  : %g ns/vector\n",timeBatch/16/numVectors*1e9);
+  printf("error  : %g\n",sqrt(difference/normalizer));
+  tree.deallocate();
+
+  numParticles = argc > 1 ? atoi(argv[1]) : 100000;
+  bodyAccel = new vec3<float>[numParticles];
+  bodyAcceld = new vec3<float>[numParticles];
+  bodyPos = new vec4<float>[numParticles];
+  for( i=0; i<numParticles; i++ ) {
+    bodyPos[i].x = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+    bodyPos[i].y = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+    bodyPos[i].z = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+    bodyPos[i].w = rand()/(float) RAND_MAX;
+  }
+  for( translationType=0; translationType<2; translationType++ ) {
+    tree.fmmMain(numParticles,1);
+    timeM2L[translationType] = t[3];
+    if( translationType == 0 ) {
+      for( i=0; i<numParticles; i++ ) bodyAcceld[i] = bodyAccel[i];
+    }
+  }
+  difference = normalizer = 0;
+  for( i=0; i<numParticles; i++ ) {
+    difference += (bodyAccel[i].x-bodyAcceld[i].x)*(bodyAccel[i].x-bodyAcceld[i].x)+
+                  (bodyAccel[i].y-bodyAcceld[i].y)*(bodyAccel[i].y-bodyAcceld[i].y)+
+                  (bodyAccel[i].z-bodyAcceld[i].z)*(bodyAccel[i].z-bodyAcceld[i].z);
+    normalizer += bodyAccel[i].x*bodyAccel[i].x+bodyAccel[i].y*bodyAccel[i].y+bodyAccel[i].z*bodyAccel[i].z;
+  }
+  printf("p      : %d\n",numExpansions);
+  printf("m2l p3 : %g s\n",timeM2L[0]);
+  printf("m2l p4 : %g s\n",timeM2L[1]);
+  printf("diff   : %g\n",sqrt(difference/normalizer));
+
+  translationType = 0;
+  kernel.direct(numParticles);
+  for( i=0; i<numParticles; i++ ) bodyAcceld[i] = bodyAccel[i];
+  for( iteration=4; iteration<=10; iteration++ ) {
+    openingAngle = iteration/10.0;
+    tic = get_time();
+    tree.fmmMain(numParticles,2);
+    toc = get_time();
+    L2norm = 0;
+    for( i=0; i<numParticles; i++ ) {
+      difference = (bodyAccel[i].x-bodyAcceld[i].x)*(bodyAccel[i].x-bodyAcceld[i].x)+
+                   (bodyAccel[i].y-bodyAcceld[i].y)*(bodyAccel[i].y-bodyAcceld[i].y)+
+                   (bodyAccel[i].z-bodyAcceld[i].z)*(bodyAccel[i].z-bodyAcceld[i].z);
+      normalizer = bodyAcceld[i].x*bodyAcceld[i].x+bodyAcceld[i].y*bodyAcceld[i].y+bodyAcceld[i].z*bodyAcceld[i].z;
+      L2norm += difference/normalizer/numParticles;
+    }
+    printf("theta  : %g time : %g error : %g\n",openingAngle,toc-tic,sqrt(L2norm));
+  }
+
+// Particles close to the leaf centers of the uniform runs above, with two corner particles keeping the same cube,
+// so the dual tree also accepts adjacent leaves for M2L and gives interior boxes 215 M2L sources
+  cluster = 1 << maxLevel;
+  for( i=0; i<numParticles; i++ ) {
+    j = rand()%(cluster*cluster*cluster);
+    bodyPos[i].x = (j/(cluster*cluster)+0.5+0.05*(rand()/(float) RAND_MAX-0.5))/cluster*2*M_PI-M_PI;
+    bodyPos[i].y = (j/cluster%cluster+0.5+0.05*(rand()/(float) RAND_MAX-0.5))/cluster*2*M_PI-M_PI;
+    bodyPos[i].z = (j%cluster+0.5+0.05*(rand()/(float) RAND_MAX-0.5))/cluster*2*M_PI-M_PI;
+    bodyPos[i].w = rand()/(float) RAND_MAX;
+  }
+  bodyPos[0].x = bodyPos[0].y = bodyPos[0].z = -M_PI;
+  bodyPos[1].x = bodyPos[1].y = bodyPos[1].z = M_PI;
+  kernel.direct(numParticles);
+  for( i=0; i<numParticles; i++ ) bodyAcceld[i] = bodyAccel[i];
+  for( iteration=1; iteration<=3; iteration+=2 ) {
+    tic = get_time();
+    tree.fmmMain(numParticles,iteration);
+    toc = get_time();
+    L2norm = 0;
+    for( i=0; i<numParticles; i++ ) {
+      difference = (bodyAccel[i].x-bodyAcceld[i].x)*(bodyAccel[i].x-bodyAcceld[i].x)+
+                   (bodyAccel[i].y-bodyAcceld[i].y)*(bodyAccel[i].y-bodyAcceld[i].y)+
+                   (bodyAccel[i].z-bodyAcceld[i].z)*(bodyAccel[i].z-bodyAcceld[i].z);
+      normalizer = bodyAcceld[i].x*bodyAcceld[i].x+bodyAcceld[i].y*bodyAcceld[i].y+bodyAcceld[i].z*bodyAcceld[i].z;
+      L2norm += difference/normalizer/numParticles;
+    }
+    printf("lattice %s : time : %g error : %g\n",iteration == 1 ? "stencil  " : "dual tree",toc-tic,sqrt(L2norm));
+  }
+
+// Clustered particles are gathered around 16 random centers with a spread of a tenth of the domain
+  for( distribution=0; distribution<2; distribution++ ) {
+    for( i=0; i<numParticles; i++ ) {
+      if( distribution == 0 ) {
+        bodyPos[i].x = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+        bodyPos[i].y = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+        bodyPos[i].z = rand()/(float) RAND_MAX*2*M_PI-M_PI;
+      } else {
+        if( i%(numParticles/16+1) == 0 ) {
+          cluster = i;
+          bodyPos[i].x = rand()/(float) RAND_MAX*1.6*M_PI-0.8*M_PI;
+          bodyPos[i].y = rand()/(float) RAND_MAX*1.6*M_PI-0.8*M_PI;
+          bodyPos[i].z = rand()/(float) RAND_MAX*1.6*M_PI-0.8*M_PI;
+        } else {
+          bodyPos[i].x = bodyPos[cluster].x+(rand()+rand()+rand()-1.5*RAND_MAX)/RAND_MAX*0.2*M_PI;
+          bodyPos[i].y = bodyPos[cluster].y+(rand()+rand()+rand()-1.5*RAND_MAX)/RAND_MAX*0.2*M_PI;
+          bodyPos[i].z = bodyPos[cluster].z+(rand()+rand()+rand()-1.5*RAND_MAX)/RAND_MAX*0.2*M_PI;
+        }
+      }
+      bodyPos[i].w = rand()/(float) RAND_MAX;
+    }
+    for( curveType=0; curveType<2; curveType++ ) {
+      tic = get_time();
+      tree.fmmMain(numParticles,1);
+      toc = get_time();
+      printf("%s %s : time : %g p2p : %g m2l : %g\n",distribution == 0 ? "uniform  " : "clustered",
+             curveType == 0 ? "morton " : "hilbert",toc-tic,t[0],t[3]);
+    }
+  }
+  curveType = 0;
+
+  delete[] CnmIn;
+  delete[] CnmOut;
+  delete[] CnmOutd;
+  delete[] bodyAccel;
+  delete[] bodyAcceld;
+  delete[] bodyPos;
+  return 0;
+}
@@ -10,15 +10,32 @@
 #include <iostream>
 #include <sys/time.h>
 
+#ifndef EXPANSION_ORDER
+#define EXPANSION_ORDER 10
+#endif
+
 const int maxParticles         = 10000000;   // max of particles
-const int numExpansions        = 10;         // order of expansion in FMM
+const int numExpansions        = EXPANSION_ORDER; // order of expansion in FMM
+const int numStencilBits       = 216;        // 6x6x6 children of the parent's neighbours
 const int maxP2PInteraction    = 27;         // max of P2P interacting boxes
-const int maxM2LInteraction    = 189;        // max of M2L interacting boxes
+const int maxP2PInteractionSkin = 125;       // max of P2P interacting boxes while the Verlet skin widens P2P to 5x5x5 leaves
+const int maxM2LInteraction    = numStencilBits-1; // max of M2L interacting boxes, 189 in the stencil and 215 in the dual tree
+const int numStencilWords      = 7;          // 32-bit words of a stencil mask
 const int numRelativeBox       = 512;        // max of relative box positioning
+const float maxVerletSkin      = 0.5f;       // max of verletSkin for treeOrFMM != 2, beyond it M2L between parents loses accuracy
 const int targetBufferSize     = 200000;     // max of GPU target buffer
 const int sourceBufferSize     = 100000;     // max of GPU source buffer
 const int threadsPerBlockTypeA = 128;        // size of GPU thread block P2P
 const int threadsPerBlockTypeB = 64;         // size of GPU thread block M2L
+const int simdLanes            = 4;          // particles per batch in CPU P2M/L2P
+const int rotationBatchSize    = 8;          // expansions rotated together by one Dnm block
+const int directSample         = 1024;       // particles timed to calibrate the direct summation
+const int directRecheck        = 16;         // calls taking direct summation before the FMM is timed again
+const int directLanes          = 8;          // targets vectorized together in the direct summation
+const int directBlockSize      = 256;        // targets per thread block of the direct summation
+const int directTileSize       = 1024;       // sources per cache tile of the direct summation
+const int errorBootstrap       = 1000;       // resamples of the bootstrap interval of sampledError
+const double errorCoverage     = 0.95;       // nominal coverage of the bootstrap interval of sampledError
 const float eps                = 1e-6;       // single precision epsilon
 const float inv4PI             = 0.25/M_PI;  // Laplace kernel coefficient
 
@@ -26,5 +43,6 @@ const int numExpansion2        = numExpansions*numExpansions;
 const int numExpansion4        = numExpansion2*numExpansion2;
 const int numCoefficients      = numExpansions*(numExpansions+1)/2;
 const int DnmSize              = (4*numExpansion2*numExpansions-numExpansions)/3;
+const int numRotationTerms     = numExpansions*(numExpansions+1)*(4*numExpansions-1)/6;
 
 #endif // __CONSTANTS_H__
@@ -0,0 +1,1046 @@
+#include "fmm.h"
+
+float Anm[numExpansion4];
+float anm[4*numExpansion2];
+int rotationOffset[numCoefficients+1];         // first term of each output coefficient in the rotation tables
+int rotationIndex[numRotationTerms][3];        // m, nk and nks of each rotation term
+double rotationConj[numRotationTerms];         // -1 where the term uses conj(Cnm), i.e. k < 0
+double solidNorm[numCoefficients]; // sqrt((n-m)!*(n+m)!) to convert between Ynm and solid harmonics
+std::complex<double> m2mOperator[8][numCoefficients][2*numCoefficients]; // fused M2M per octant, level-normalized
+std::complex<double> l2lOperator[8][numCoefficients][2*numCoefficients]; // fused L2L per octant, level-normalized
+double m2lRhoInv[numRelativeBox][2*numExpansions]; // |offset|^-n of each M2L offset in units of the box size
+std::complex<double> m2lInm[numRelativeBox][numExpansions*(2*numExpansions-1)]; // irregular harmonics of each M2L offset
+FmmSystem tree;
+
+void cart2sph(double& r, double& theta, double& phi, double dx, double dy, double dz) {
+  r=sqrtf(dx*dx+dy*dy+dz*dz)+eps;
+  theta=acosf(dz/r);
+  if(fabs(dx)+fabs(dy)<eps){
+    phi=0;
+  }
+  else if(fabs(dx)<eps){
+    phi=dy/fabs(dy)*M_PI*0.5;
+  }
+  else if(dx>0){
+    phi=atanf(dy/dx);
+  }
+  else{
+    phi=atanf(dy/dx)+M_PI;
+  }
+}
+
+// Regular solid harmonics R_n^m = r^n P_n^m exp(m*phi*I)/(n+m)! from Cartesian coordinates
+void cart2reg(double (*Rre)[simdLanes], double (*Rim)[simdLanes], double* dx, double* dy, double* dz, int numOrder) {
+  int l,n,m,nm,nm1,nm2;
+  double r2[simdLanes];
+
+  for( l=0; l<simdLanes; l++ ) {
+    r2[l] = dx[l]*dx[l]+dy[l]*dy[l]+dz[l]*dz[l];
+    Rre[0][l] = 1;
+    Rim[0][l] = 0;
+  }
+  for( m=0; m<numOrder; m++ ) {
+    nm = m*(m+1)/2+m;
+    if( m > 0 ) {
+      nm1 = (m-1)*m/2+m-1;
+      for( l=0; l<simdLanes; l++ ) {
+        Rre[nm][l] = -(dx[l]*Rre[nm1][l]-dy[l]*Rim[nm1][l])/(2*m);
+        Rim[nm][l] = -(dx[l]*Rim[nm1][l]+dy[l]*Rre[nm1][l])/(2*m);
+      }
+    }
+    if( m+1 < numOrder ) {
+      nm1 = nm;
+      nm = (m+1)*(m+2)/2+m;
+      for( l=0; l<simdLanes; l++ ) {
+        Rre[nm][l] = dz[l]*Rre[nm1][l];
+        Rim[nm][l] = dz[l]*Rim[nm1][l];
+      }
+    }
+    for( n=m+2; n<numOrder; n++ ) {
+      nm = n*(n+1)/2+m;
+      nm1 = (n-1)*n/2+m;
+      nm2 = (n-2)*(n-1)/2+m;
+      for( l=0; l<simdLanes; l++ ) {
+        Rre[nm][l] = ((2*n-1)*dz[l]*Rre[nm1][l]-r2[l]*Rre[nm2][l])/((n-m)*(n+m));
+        Rim[nm][l] = ((2*n-1)*dz[l]*Rim[nm1][l]-r2[l]*Rim[nm2][l])/((n-m)*(n+m));
+      }
+    }
+  }
+}
+
+// Irregular solid harmonics I_n^m = (n-m)! P_n^m exp(m*phi*I)/r^(n+1) from Cartesian coordinates
+void cart2irr(double (*Ire)[simdLanes], double (*Iim)[simdLanes], double* dx, double* dy, double* dz, int numOrder) {
+  int l,n,m,nm,nm1,nm2;
+  double invR2[simdLanes];
+
+  for( l=0; l<simdLanes; l++ ) {
+    invR2[l] = 1/(dx[l]*dx[l]+dy[l]*dy[l]+dz[l]*dz[l]+eps*eps);
+    Ire[0][l] = sqrt(invR2[l]);
+    Iim[0][l] = 0;
+  }
+  for( m=0; m<numOrder; m++ ) {
+    nm = m*(m+1)/2+m;
+    if( m > 0 ) {
+      nm1 = (m-1)*m/2+m-1;
+      for( l=0; l<simdLanes; l++ ) {
+        Ire[nm][l] = -(2*m-1)*(dx[l]*Ire[nm1][l]-dy[l]*Iim[nm1][l])*invR2[l];
+        Iim[nm][l] = -(2*m-1)*(dx[l]*Iim[nm1][l]+dy[l]*Ire[nm1][l])*invR2[l];
+      }
+    }
+    if( m+1 < numOrder ) {
+      nm1 = nm;
+      nm = (m+1)*(m+2)/2+m;
+      for( l=0; l<simdLanes; l++ ) {
+        Ire[nm][l] = (2*m+1)*dz[l]*Ire[nm1][l]*invR2[l];
+        Iim[nm][l] = (2*m+1)*dz[l]*Iim[nm1][l]*invR2[l];
+      }
+    }
+    for( n=m+2; n<numOrder; n++ ) {
+      nm = n*(n+1)/2+m;
+      nm1 = (n-1)*n/2+m;
+      nm2 = (n-2)*(n-1)/2+m;
+      for( l=0; l<simdLanes; l++ ) {
+        Ire[nm][l] = ((2*n-1)*dz[l]*Ire[nm1][l]-(n+m-1)*(n-m-1)*Ire[nm2][l])*invR2[l];
+        Iim[nm][l] = ((2*n-1)*dz[l]*Iim[nm1][l]-(n+m-1)*(n-m-1)*Iim[nm2][l])*invR2[l];
+      }
+    }
+  }
+}
+
+// Irregular harmonic of any sign of m from the packed m >= 0 table, Inm(-m) = (-1)^m*conj(Inm(m))
+std::complex<double> irregular(std::complex<double>* Inm, int n, int m) {
+  if( m >= 0 ) return Inm[n*(n+1)/2+m];
+  return pow(-1.0,m)*conj(Inm[n*(n+1)/2-m]);
+}
+
+// precalculate M2L translation matrix and Wigner rotation matrix
+void FmmKernel::precalc() {
+  int n,m,nm,nabsm,j,k,nk,npn,nmn,npm,nmm,nmk,i,nmk1,nm1k,nmk2,je,nm1;
+  double dx[simdLanes],dy[simdLanes],dz[simdLanes];
+  double Ire[numExpansions*(2*numExpansions-1)][simdLanes],Iim[numExpansions*(2*numExpansions-1)][simdLanes];
+  std::complex<double> CnmVectorA[numCoefficients],CnmVectorB[numCoefficients],CnmScalar;
+  vec3<int> boxIndex3D;
+  vec3<double> dist;
+  double anmk[2][numExpansion4];
+  double Dnmd[numExpansion4];
+  double fnma,fnpa,pn,p,p1,p2,anmd,anmkd,rho,alpha,beta,sc,ank,ek,octantDistance;
+  std::complex<double> expBeta[numExpansion2],I(0.0,1.0);
+
+  int jk,jkn,jnk;
+  double fnmm,fnpm,fad;
+
+  for( n=0; n<2*numExpansions; n++ ) {
+    for( m=-n; m<=n; m++ ) {
+      nm = n*n+n+m;
+      nabsm = abs(m);
+      fnmm = 1.0;
+      for( i=1; i<=n-m; i++ ) fnmm *= i;
+      fnpm = 1.0;
+      for( i=1; i<=n+m; i++ ) fnpm *= i;
+      fnma = 1.0;
+      for( i=1; i<=n-nabsm; i++ ) fnma *= i;
+      fnpa = 1.0;
+      for( i=1; i<=n+nabsm; i++ ) fnpa *= i;
+      factorial[nm] = sqrt(fnma/fnpa);
+      fad = sqrt(fnmm*fnpm);
+      anm[nm] = pow(-1.0,n)/fad;
+    }
+  }
+
+  for( n=0; n<numExpansions; n++ ) {
+    for( m=0; m<=n; m++ ) {
+      fnmm = 1.0;
+      for( i=1; i<=n-m; i++ ) fnmm *= i;
+      fnpm = 1.0;
+      for( i=1; i<=n+m; i++ ) fnpm *= i;
+      solidNorm[n*(n+1)/2+m] = sqrt(fnmm*fnpm);
+    }
+  }
+
+  for( j=0; j<numExpansions; j++) {
+    for( k=-j; k<=j; k++ ){
+      jk = j*j+j+k;
+      for( n=abs(k); n<numExpansions; n++ ) {
+        nk = n*n+n+k;
+        jkn = jk*numExpansion2+nk;
+        jnk = (j+n)*(j+n)+j+n;
+        Anm[jkn] = pow(-1.0,j+k)*anm[nk]*anm[jk]/anm[jnk];
+      }
+    }
+  }
+
+  pn = 1;
+  for( m=0; m<2*numExpansions; m++ ) {
+    p = pn;
+    npn = m*m+2*m;
+    nmn = m*m;
+    Ynm[npn] = factorial[npn]*p;
+    Ynm[nmn] = conj(Ynm[npn]);
+    p1 = p;
+    p = (2*m+1)*p;
+    for( n=m+1; n<2*numExpansions; n++ ) {
+      npm = n*n+n+m;
+      nmm = n*n+n-m;
+      Ynm[npm] = factorial[npm]*p;
+      Ynm[nmm] = conj(Ynm[npm]);
+      p2 = p1;
+      p1 = p;
+      p = ((2*n+1)*p1-(n+m)*p2)/(n-m+1);
+    }
+    pn = 0;
+  }
+
+  for( n=0; n<numExpansions; n++ ) {
+    for( m=1; m<=n; m++ ) {
+      anmd = n*(n+1)-m*(m-1);
+      for( k=1-m; k<m; k++ ) {
+        nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+        anmkd = ((double) (n*(n+1)-k*(k+1)))/(n*(n+1)-m*(m-1));
+        anmk[0][nmk] = -(m+k)/sqrt(anmd);
+        anmk[1][nmk] = sqrt(anmkd);
+      }
+    }
+  }
+
+  for( i=0; i<numRelativeBox; i++ ) {
+    tree.unmorton(i,boxIndex3D);
+    dist.x = boxIndex3D.x-3;
+    dist.y = boxIndex3D.y-3;
+    dist.z = boxIndex3D.z-3;
+    cart2sph(rho,alpha,beta,dist.x,dist.y,dist.z);
+
+    sc = sin(alpha)/(1+cos(alpha));
+    for( n=0; n<4*numExpansions-3; n++ ) {
+      expBeta[n] = exp((n-2*numExpansions+2)*beta*I);
+    }
+
+    for( n=0; n<numExpansions; n++ )  {
+      nmk = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+n;
+      Dnmd[nmk] = pow(cos(alpha*0.5),2*n);
+      for( k=n; k>=1-n; k-- ) {
+        nmk = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+k;
+        nmk1 = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+k-1;
+        ank = ((double) n+k)/(n-k+1);
+        Dnmd[nmk1] = sqrt(ank)*tan(alpha*0.5)*Dnmd[nmk];
+      }
+      for( m=n; m>=1; m-- ) {
+        for( k=m-1; k>=1-m; k-- ){
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k+1;
+          nm1k = (4*n*n*n+6*n*n+5*n)/3+(m-1)*(2*n+1)+k;
+          Dnmd[nm1k] = anmk[1][nmk]*Dnmd[nmk1]+anmk[0][nmk]*sc*Dnmd[nmk];
+        }
+      }
+    }
+
+    for( n=1; n<numExpansions; n++ ) {
+      for( m=0; m<=n; m++ ) {
+        for( k=-m; k<=-1; k++ ) {
+          ek = pow(-1.0,k);
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3-k*(2*n+1)-m;
+          Dnmd[nmk] = ek*Dnmd[nmk];
+          Dnmd[nmk1] = pow(-1.0,m+k)*Dnmd[nmk];
+        }
+        for( k=0; k<=m; k++ ) {
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3+k*(2*n+1)+m;
+          nmk2 = (4*n*n*n+6*n*n+5*n)/3-k*(2*n+1)-m;
+          Dnmd[nmk1] = pow(-1.0,m+k)*Dnmd[nmk];
+          Dnmd[nmk2] = Dnmd[nmk1];
+        }
+      }
+    }
+
+    for( n=0; n<numExpansions; n++ ) {
+      for( m=0; m<=n; m++ ) {
+        for( k=-n; k<=n; k++ ) {
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nk = n*(n+1)+k;
+          Dnm[i][m][nk] = Dnmd[nmk]*expBeta[k+m+2*numExpansions-2];
+        }
+      }
+    }
+
+    alpha = -alpha;
+    beta = -beta;
+
+    sc = sin(alpha)/(1+cos(alpha));
+    for( n=0; n<4*numExpansions-3; n++ ) {
+      expBeta[n] = exp((n-2*numExpansions+2)*beta*I);
+    }
+
+    for( n=0; n<numExpansions; n++ ) {
+      nmk = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+n;
+      Dnmd[nmk] = pow(cos(alpha*0.5),2*n);
+      for( k=n; k>=1-n; k-- ) {
+        nmk = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+k;
+        nmk1 = (4*n*n*n+6*n*n+5*n)/3+n*(2*n+1)+k-1;
+        ank = ((double) n+k)/(n-k+1);
+        Dnmd[nmk1] = sqrt(ank)*tan(alpha*0.5)*Dnmd[nmk];
+      }
+      for( m=n; m>=1; m-- ) {
+        for( k=m-1; k>=1-m; k-- ) {
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k+1;
+          nm1k = (4*n*n*n+6*n*n+5*n)/3+(m-1)*(2*n+1)+k;
+          Dnmd[nm1k] = anmk[1][nmk]*Dnmd[nmk1]+anmk[0][nmk]*sc*Dnmd[nmk];
+        }
+      }
+    }
+
+    for( n=1; n<numExpansions; n++ ) {
+      for( m=0; m<=n; m++ ) {
+        for( k=-m; k<=-1; k++ ) {
+          ek = pow(-1.0,k);
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3-k*(2*n+1)-m;
+          Dnmd[nmk] = ek*Dnmd[nmk];
+          Dnmd[nmk1] = pow(-1.0,m+k)*Dnmd[nmk];
+        }
+        for( k=0; k<=m; k++ ) {
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nmk1 = (4*n*n*n+6*n*n+5*n)/3+k*(2*n+1)+m;
+          nmk2 = (4*n*n*n+6*n*n+5*n)/3-k*(2*n+1)-m;
+          Dnmd[nmk1] = pow(-1.0,m+k)*Dnmd[nmk];
+          Dnmd[nmk2] = Dnmd[nmk1];
+        }
+      }
+    }
+
+    for( n=0; n<numExpansions; n++ ) {
+      for( m=0; m<=n; m++ ) {
+        for( k=-n; k<=n; k++ ) {
+          nmk = (4*n*n*n+6*n*n+5*n)/3+m*(2*n+1)+k;
+          nk = n*(n+1)+k;
+          Dnm[i+numRelativeBox][m][nk] = Dnmd[nmk]*expBeta[k+m+2*numExpansions-2];
+        }
+      }
+    }
+  }
+
+  i = 0;
+  for( n=0; n<numExpansions; n++ ) {
+    for( m=0; m<=n; m++ ) {
+      rotationOffset[n*(n+1)/2+m] = i;
+      for( k=-n; k<=n; k++ ) {
+        rotationIndex[i][0] = m;
+        rotationIndex[i][1] = n*(n+1)+k;
+        rotationIndex[i][2] = n*(n+1)/2+abs(k);
+        rotationConj[i] = k < 0 ? -1 : 1;
+        i++;
+      }
+    }
+  }
+  rotationOffset[numCoefficients] = i;
+
+// Expansions are stored as Mnm/s^n and Lnm*s^(n+1), s being the box size of their level,
+// so the translation operators below are the same for every level and domain size
+  for( je=0; je<numRelativeBox; je++ ) {
+    tree.unmorton(je,boxIndex3D);
+    rho = sqrt(double((boxIndex3D.x-3)*(boxIndex3D.x-3)+(boxIndex3D.y-3)*(boxIndex3D.y-3)+(boxIndex3D.z-3)*(boxIndex3D.z-3)));
+    m2lRhoInv[je][0] = 1;
+    for( n=1; n<2*numExpansions; n++ ) m2lRhoInv[je][n] = m2lRhoInv[je][n-1]/rho;
+  }
+  for( je=0; je<numRelativeBox; je+=simdLanes ) {
+    for( i=0; i<simdLanes; i++ ) {
+      tree.unmorton(je+i,boxIndex3D);
+      dx[i] = boxIndex3D.x-3;
+      dy[i] = boxIndex3D.y-3;
+      dz[i] = boxIndex3D.z-3;
+    }
+    cart2irr(Ire,Iim,dx,dy,dz,2*numExpansions-1);
+    for( nm=0; nm<numExpansions*(2*numExpansions-1); nm++ ) {
+      for( i=0; i<simdLanes; i++ ) {
+        m2lInm[je+i][nm] = std::complex<double>(Ire[nm][i],Iim[nm][i]);
+      }
+    }
+  }
+
+// Fused rotate-translate-rotate operators of the 8 child octants, built column by column
+// For planar systems the box centers lie in the plane, so the children are offset only along x and y
+  octantDistance = planarSystem ? sqrt(2.0) : sqrt(3.0);
+  for( i=0; i<8; i++ ) {
+    for( j=0; j<2*numCoefficients; j++ ) {
+      for( nm=0; nm<numCoefficients; nm++ ) CnmVectorA[nm] = 0;
+      CnmVectorA[j/2] = j%2 == 0 ? 1 : I;
+      tree.unmorton(i,boxIndex3D);
+      boxIndex3D.x = 4-boxIndex3D.x*2;
+      boxIndex3D.y = 4-boxIndex3D.y*2;
+      boxIndex3D.z = planarSystem ? 3 : 4-boxIndex3D.z*2;
+      tree.morton1(boxIndex3D,je,3);
+      rotation(CnmVectorA,CnmVectorB,Dnm[je]);
+      for( n=0; n<numExpansions; n++ ) {
+        for( m=0; m<=n; m++ ) {
+          nk = n*n+n+m;
+          CnmScalar = 0;
+          for( k=0; k<=n-m; k++ ) {
+            nmk = (n-k)*(n-k)+n-k+m;
+            nm1 = k*k+k;
+            CnmScalar += CnmVectorB[(n-k)*(n-k+1)/2+m]*(pow(-1.0,k)*anm[nm1]*anm[nmk]/anm[nk]*pow(octantDistance/4,k)*pow(0.5,n-k)*Ynm[nm1]);
+          }
+          CnmVectorA[n*(n+1)/2+m] = CnmScalar;
+        }
+      }
+      rotation(CnmVectorA,CnmVectorB,Dnm[je+numRelativeBox]);
+      for( nm=0; nm<numCoefficients; nm++ ) m2mOperator[i][nm][j] = CnmVectorB[nm];
+
+      for( nm=0; nm<numCoefficients; nm++ ) CnmVectorA[nm] = 0;
+      CnmVectorA[j/2] = j%2 == 0 ? 1 : I;
+      tree.unmorton(i,boxIndex3D);
+      boxIndex3D.x = boxIndex3D.x*2+2;
+      boxIndex3D.y = boxIndex3D.y*2+2;
+      boxIndex3D.z = planarSystem ? 3 : boxIndex3D.z*2+2;
+      tree.morton1(boxIndex3D,je,3);
+      rotation(CnmVectorA,CnmVectorB,Dnm[je]);
+      for( n=0; n<numExpansions; n++ ) {
+        for( m=0; m<=n; m++ ) {
+          nk = n*n+n+m;
+          CnmScalar = 0;
+          for( k=n; k<numExpansions; k++ ) {
+            nmk = (k-n)*(k-n)+k-n;
+            nm1 = k*k+k+m;
+            CnmScalar += CnmVectorB[k*(k+1)/2+m]*(anm[nmk]*anm[nk]/anm[nm1]*pow(octantDistance/2,k-n)*pow(0.5,k+1)*Ynm[nmk]);
+          }
+          CnmVectorA[n*(n+1)/2+m] = CnmScalar;
+        }
+      }
+      rotation(CnmVectorA,CnmVectorB,Dnm[je+numRelativeBox]);
+      for( nm=0; nm<numCoefficients; nm++ ) l2lOperator[i][nm][j] = CnmVectorB[nm];
+    }
+  }
+
+  for( j=0; j<numBoxIndexTotal*numVectors; j++ ) {
+    for( i=0; i<numCoefficients; i++ ) {
+      Mnm[j][i] = 0;
+    }
+  }
+}
+
+// Spherical harmonic rotation
+void FmmKernel::rotation(std::complex<double>* Cnm, std::complex<double>* CnmOut, std::complex<double>** Dnm) {
+  int n,m,nms,k,nk,nks;
+  std::complex<double> CnmScalar;
+
+  for( n=0; n<numExpansions; n++ ) {
+    for( m=0; m<=n; m++ ) {
+      nms = n*(n+1)/2+m;
+      CnmScalar = 0;
+      for( k=-n; k<=-1; k++ ) {
+        nk = n*(n+1)+k;
+        nks = n*(n+1)/2-k;
+        CnmScalar += Dnm[m][nk]*conj(Cnm[nks]);
+      }
+      for( k=0; k<=n; k++ ) {
+        nk = n*(n+1)+k;
+        nks = n*(n+1)/2+k;
+        CnmScalar += Dnm[m][nk]*Cnm[nks];
+      }
+      CnmOut[nms] = CnmScalar;
+    }
+  }
+}
+
+// Spherical harmonic rotation of several expansions by the same Dnm block
+void FmmKernel::rotationBatch(std::complex<double> (*Cnm)[numCoefficients], std::complex<double> (*CnmOut)[numCoefficients],
+                              std::complex<double>** Dnm, int numVectors) {
+  int ibase,nv,i,j,nms,it;
+  double DnmRe[numRotationTerms],DnmIm[numRotationTerms],DnmReConj[numRotationTerms],DnmImConj[numRotationTerms];
+  double CnmRe[numCoefficients][rotationBatchSize],CnmIm[numCoefficients][rotationBatchSize];
+  double CnmOutRe[rotationBatchSize],CnmOutIm[rotationBatchSize];
+
+  for( it=0; it<numRotationTerms; it++ ) {
+    DnmRe[it] = real(Dnm[rotationIndex[it][0]][rotationIndex[it][1]]);
+    DnmIm[it] = imag(Dnm[rotationIndex[it][0]][rotationIndex[it][1]]);
+    DnmReConj[it] = rotationConj[it]*DnmRe[it];
+    DnmImConj[it] = rotationConj[it]*DnmIm[it];
+  }
+  for( ibase=0; ibase<numVectors; ibase+=rotationBatchSize ) {
+    nv = std::min(rotationBatchSize,numVectors-ibase);
+    for( j=0; j<numCoefficients; j++ ) {
+      for( i=0; i<nv; i++ ) {
+        CnmRe[j][i] = real(Cnm[ibase+i][j]);
+        CnmIm[j][i] = imag(Cnm[ibase+i][j]);
+      }
+      for( i=nv; i<rotationBatchSize; i++ ) {
+        CnmRe[j][i] = 0;
+        CnmIm[j][i] = 0;
+      }
+    }
+    for( nms=0; nms<numCoefficients; nms++ ) {
+      for( i=0; i<rotationBatchSize; i++ ) {
+        CnmOutRe[i] = 0;
+        CnmOutIm[i] = 0;
+      }
+      for( it=rotationOffset[nms]; it<rotationOffset[nms+1]; it++ ) {
+        j = rotationIndex[it][2];
+        for( i=0; i<rotationBatchSize; i++ ) {
+          CnmOutRe[i] += DnmRe[it]*CnmRe[j][i]-DnmImConj[it]*CnmIm[j][i];
+          CnmOutIm[i] += DnmReConj[it]*CnmIm[j][i]+DnmIm[it]*CnmRe[j][i];
+        }
+      }
+      for( i=0; i<nv; i++ ) {
+        CnmOut[ibase+i][nms] = std::complex<double>(CnmOutRe[i],CnmOutIm[i]);
+      }
+    }
+  }
+}
+
+// p2m to l2p take numVectors expansions per box, so several weight vectors share one pass of them
+int FmmKernel::multiVector() {
+  return 1;
+}
+
+// p2m
+void FmmKernel::p2m(int numBoxIndex) {
+  int jj,j,jbase,jend,l,nms,v;
+  vec3<float> boxCenter;
+  double boxSize,invBoxSize;
+  double dx[simdLanes],dy[simdLanes],dz[simdLanes],mass[simdLanes];
+  double Rre[numCoefficients][simdLanes],Rim[numCoefficients][simdLanes];
+  double (*MnmRe)[numCoefficients],(*MnmIm)[numCoefficients];
+  MnmRe = new double [numVectors][numCoefficients];
+  MnmIm = new double [numVectors][numCoefficients];
+
+  boxSize = rootBoxSize/(1 << maxLevel);
+  invBoxSize = 1/boxSize;
+  for( jj=0; jj<numBoxIndex; jj++ ) {
+    boxCenter = boxCenterFull[jj];
+    for( v=0; v<numVectors; v++ ) {
+      for( j=0; j<numCoefficients; j++ ) {
+        MnmRe[v][j] = 0;
+        MnmIm[v][j] = 0;
+      }
+    }
+    for( jbase=particleOffset[0][jj]; jbase<=particleOffset[1][jj]; jbase+=simdLanes ) {
+      jend = std::min(jbase+simdLanes-1,particleOffset[1][jj]);
+// Gather a batch of particles, padding the remainder with copies of the last one
+      for( l=0; l<simdLanes; l++ ) {
+        j = std::min(jbase+l,jend);
+        dx[l] = (bodyPos[j].x-boxCenter.x)*invBoxSize;
+        dy[l] = (bodyPos[j].y-boxCenter.y)*invBoxSize;
+        dz[l] = (bodyPos[j].z-boxCenter.z)*invBoxSize;
+      }
+      cart2reg(Rre,Rim,dx,dy,dz,numExpansions);
+// Mnm/s^n = sum of mass*(rho/s)^n*Ynm(-m) = sum of mass*solidNorm*conj(Rnm(dist/s))
+// The harmonics of the batch are shared by the weights of every vector, the padding lanes are massless
+      for( v=0; v<numVectors; v++ ) {
+        for( l=0; l<simdLanes; l++ ) {
+          j = jbase+l;
+          mass[l] = j > jend ? 0 : bodyWeights ? sortedWeights[j*numVectors+v] : bodyPos[j].w;
+        }
+        for( nms=0; nms<numCoefficients; nms++ ) {
+          for( l=0; l<simdLanes; l++ ) {
+            MnmRe[v][nms] += mass[l]*Rre[nms][l];
+            MnmIm[v][nms] -= mass[l]*Rim[nms][l];
+          }
+        }
+      }
+    }
+    for( v=0; v<numVectors; v++ ) {
+      for( j=0; j<numCoefficients; j++ ) {
+        Mnm[jj*numVectors+v][j] = solidNorm[j]*std::complex<double>(MnmRe[v][j],MnmIm[v][j]);
+      }
+    }
+  }
+  delete[] MnmRe;
+  delete[] MnmIm;
+}
+
+// m2m
+void FmmKernel::m2m(int numBoxIndex, int numBoxIndexOld, int numLevel) {
+  int ii,ib,i,j,jj,nfjc,jb,k,jks,n,nks,v;
+  double *MnmVector;
+  std::complex<double> *MnmScalar,m2mScalar;
+  MnmVector = new double [2*numCoefficients*numVectors];
+  MnmScalar = new std::complex<double> [numVectors];
+
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    ib = ii+levelOffset[numLevel-1];
+    for( v=0; v<numVectors; v++ ) {
+      for( j=0; j<numCoefficients; j++ ) {
+        Mnm[ib*numVectors+v][j] = 0;
+      }
+    }
+  }
+  for( jj=0; jj<numBoxIndexOld; jj++ ) {
+    jb = jj+levelOffset[numLevel];
+    nfjc = boxIndexFull[jb]%8;
+    ib = boxParent[jb];
+// The child's vectors are interleaved, so each operator entry is applied to all of them in turn
+    for( n=0; n<numExpansions; n++ ) {
+      for( k=0; k<=n; k++ ) {
+        nks = n*(n+1)/2+k;
+        for( v=0; v<numVectors; v++ ) {
+          MnmVector[(2*nks+0)*numVectors+v] = real(Mnm[jb*numVectors+v][nks]);
+          MnmVector[(2*nks+1)*numVectors+v] = imag(Mnm[jb*numVectors+v][nks]);
+        }
+      }
+    }
+// Degree j of the parent only sees degrees <= j of the child
+    for( j=0; j<numExpansions; j++ ) {
+      for( k=0; k<=j; k++ ) {
+        jks = j*(j+1)/2+k;
+        for( v=0; v<numVectors; v++ ) MnmScalar[v] = 0;
+        for( i=0; i<(j+1)*(j+2); i++ ) {
+          m2mScalar = m2mOperator[nfjc][jks][i];
+          for( v=0; v<numVectors; v++ ) {
+            MnmScalar[v] += m2mScalar*MnmVector[i*numVectors+v];
+          }
+        }
+        for( v=0; v<numVectors; v++ ) Mnm[ib*numVectors+v][jks] += MnmScalar[v];
+      }
+    }
+  }
+  delete[] MnmVector;
+  delete[] MnmScalar;
+}
+
+// m2l
+void FmmKernel::m2l(int numBoxIndex, int numLevel) {
+  int i,j,ii,ij,jj,jb,je,k,jk,jks,n,m,nk,nks,nms,jkn,jnk,numPair,ip,iv,nv,v,numParity,parityList[numCoefficients];
+  int *pairOffset,(*pairList)[2],(*pairBuffer)[3],interactionList[maxM2LInteraction],offsetCode[maxM2LInteraction];
+#ifdef ROTATION_PROFILE
+  double rotationTic;
+#endif
+  std::complex<double> LnmVectorA[rotationBatchSize][numCoefficients],MnmVectorA[rotationBatchSize][numCoefficients];
+  std::complex<double> LnmVectorB[rotationBatchSize][numCoefficients],MnmVectorB[rotationBatchSize][numCoefficients];
+  double CnmDirect[4][numCoefficients][numCoefficients],c0,c1,c2,c3,*MnmRe,*MnmIm,*LnmRe,*LnmIm;
+  std::complex<double> cnm,CnmPlus,CnmMinus;
+  MnmRe = new double [numCoefficients*numVectors];
+  MnmIm = new double [numCoefficients*numVectors];
+  LnmRe = new double [numVectors];
+  LnmIm = new double [numVectors];
+
+  if( numLevel == 2 ) {
+    for( i=0; i<numBoxIndex*numVectors; i++ ) {
+      for( j=0; j<numCoefficients; j++ ) {
+        Lnm[i][j] = 0;
+      }
+    }
+  }
+
+// Bucket the (target,source) pairs by relative offset so each Dnm block is applied to a batch
+  numPair = 0;
+  for( ii=0; ii<numBoxIndex; ii++ ) numPair += numInteraction[ii];
+  pairOffset = new int [numRelativeBox+1];
+  pairList = new int [numPair][2];
+  pairBuffer = new int [numPair][3];
+  for( je=0; je<=numRelativeBox; je++ ) pairOffset[je] = 0;
+  ip = 0;
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    tree.getInteractionListOfBox(ii,numLevel,interactionList,offsetCode);
+    for( ij=0; ij<numInteraction[ii]; ij++ ) {
+      jj = interactionList[ij];
+      je = offsetCode[ij];
+      pairBuffer[ip][0] = ii;
+      pairBuffer[ip][1] = jj;
+      pairBuffer[ip][2] = je;
+      pairOffset[je+1]++;
+      ip++;
+    }
+  }
+  for( je=0; je<numRelativeBox; je++ ) pairOffset[je+1] += pairOffset[je];
+  for( ip=0; ip<numPair; ip++ ) {
+    je = pairBuffer[ip][2];
+    pairList[pairOffset[je]][0] = pairBuffer[ip][0];
+    pairList[pairOffset[je]][1] = pairBuffer[ip][1];
+    pairOffset[je]++;
+  }
+  delete[] pairBuffer;
+  for( je=numRelativeBox; je>0; je-- ) pairOffset[je] = pairOffset[je-1];
+  pairOffset[0] = 0;
+
+// For planar systems the coefficients with odd n+m vanish in the plane of the box centers,
+// so the direct translation below runs on the even ones only, a quarter of the work of the full matrix
+  numParity = 0;
+  for( n=0; n<numExpansions; n++ ) {
+    for( m=0; m<=n; m++ ) {
+      if( planarSystem && (n+m)%2 == 1 ) continue;
+      parityList[numParity] = n*(n+1)/2+m;
+      numParity++;
+    }
+  }
+
+  for( je=0; je<numRelativeBox; je++ ) {
+    if( pairOffset[je] == pairOffset[je+1] ) continue;
+    if( translationType == 1 || planarSystem ) {
+// Direct O(p^4) translation Lnm = (-1)^(j+k) sum of Mnm*Inm(m-k) of the offset, Mnm(-m) entering through conj,
+// stored as the real 2x2 blocks acting on (Re Mnm, Im Mnm)
+      for( j=0; j<numExpansions; j++ ) {
+        for( k=0; k<=j; k++ ) {
+          if( planarSystem && (j+k)%2 == 1 ) continue;
+          jks = j*(j+1)/2+k;
+          for( n=0; n<numExpansions; n++ ) {
+            for( m=0; m<=n; m++ ) {
+              if( planarSystem && (n+m)%2 == 1 ) continue;
+              nms = n*(n+1)/2+m;
+              cnm = pow(-1.0,j+k)/solidNorm[jks]/solidNorm[nms];
+              CnmPlus = cnm*irregular(m2lInm[je],j+n,m-k);
+              CnmMinus = m == 0 ? 0.0 : pow(-1.0,m)*cnm*irregular(m2lInm[je],j+n,-m-k);
+              CnmDirect[0][jks][nms] = real(CnmPlus)+real(CnmMinus);
+              CnmDirect[1][jks][nms] = imag(CnmMinus)-imag(CnmPlus);
+              CnmDirect[2][jks][nms] = imag(CnmPlus)+imag(CnmMinus);
+              CnmDirect[3][jks][nms] = real(CnmPlus)-real(CnmMinus);
+            }
+          }
+        }
+      }
+// The vectors of a pair are interleaved, so the matrix is applied to all of them in one pass over its entries
+      for( ip=pairOffset[je]; ip<pairOffset[je+1]; ip++ ) {
+        ii = pairList[ip][0];
+        jb = pairList[ip][1]+levelOffset[numLevel-1];
+        for( i=0; i<numParity; i++ ) {
+          nms = parityList[i];
+          for( v=0; v<numVectors; v++ ) {
+            MnmRe[nms*numVectors+v] = real(Mnm[jb*numVectors+v][nms]);
+            MnmIm[nms*numVectors+v] = imag(Mnm[jb*numVectors+v][nms]);
+          }
+        }
+        for( ij=0; ij<numParity; ij++ ) {
+          jks = parityList[ij];
+          for( v=0; v<numVectors; v++ ) {
+            LnmRe[v] = 0;
+            LnmIm[v] = 0;
+          }
+          for( i=0; i<numParity; i++ ) {
+            nms = parityList[i];
+            c0 = CnmDirect[0][jks][nms];
+            c1 = CnmDirect[1][jks][nms];
+            c2 = CnmDirect[2][jks][nms];
+            c3 = CnmDirect[3][jks][nms];
+            for( v=0; v<numVectors; v++ ) {
+              LnmRe[v] += c0*MnmRe[nms*numVectors+v]+c1*MnmIm[nms*numVectors+v];
+              LnmIm[v] += c2*MnmRe[nms*numVectors+v]+c3*MnmIm[nms*numVectors+v];
+            }
+          }
+          for( v=0; v<numVectors; v++ ) {
+            Lnm[ii*numVectors+v][jks] += std::complex<double>(LnmRe[v],LnmIm[v]);
+          }
+        }
+      }
+      continue;
+    }
+// Each batch takes rotationBatchSize expansions from the pairs of this offset, all vectors of a pair in turn
+// Built with -DROTATION_PROFILE the rotation time goes to t[8], which reads the clock around every batch
+    for( iv=pairOffset[je]*numVectors; iv<pairOffset[je+1]*numVectors; iv+=rotationBatchSize ) {
+      nv = std::min(rotationBatchSize,pairOffset[je+1]*numVectors-iv);
+      for( i=0; i<nv; i++ ) {
+        jb = (pairList[(iv+i)/numVectors][1]+levelOffset[numLevel-1])*numVectors+(iv+i)%numVectors;
+        for( j=0; j<numCoefficients; j++ ) {
+          MnmVectorB[i][j] = Mnm[jb][j];
+        }
+      }
+#ifdef ROTATION_PROFILE
+      rotationTic = get_time();
+#endif
+      rotationBatch(MnmVectorB,MnmVectorA,Dnm[je],nv);
+#ifdef ROTATION_PROFILE
+      t[8] += get_time()-rotationTic;
+#endif
+      for( j=0; j<numExpansions; j++ ) {
+        for( k=0; k<=j; k++ ) {
+          jk = j*j+j+k;
+          jks = j*(j+1)/2+k;
+          for( i=0; i<nv; i++ ) {
+            LnmVectorA[i][jks] = 0;
+          }
+          for( n=abs(k); n<numExpansions; n++ ) {
+            nk = n*n+n+k;
+            nks = n*(n+1)/2+k;
+            jkn = jk*numExpansion2+nk;
+            jnk = (j+n)*(j+n)+j+n;
+            cnm = Anm[jkn]*m2lRhoInv[je][j+n+1]*Ynm[jnk];
+            for( i=0; i<nv; i++ ) {
+              LnmVectorA[i][jks] += MnmVectorA[i][nks]*cnm;
+            }
+          }
+        }
+      }
+#ifdef ROTATION_PROFILE
+      rotationTic = get_time();
+#endif
+      rotationBatch(LnmVectorA,LnmVectorB,Dnm[je+numRelativeBox],nv);
+#ifdef ROTATION_PROFILE
+      t[8] += get_time()-rotationTic;
+#endif
+      for( i=0; i<nv; i++ ) {
+        ii = pairList[(iv+i)/numVectors][0]*numVectors+(iv+i)%numVectors;
+        for( j=0; j<numCoefficients; j++ ) {
+          Lnm[ii][j] += LnmVectorB[i][j];
+        }
+      }
+    }
+  }
+  delete[] pairOffset;
+  delete[] pairList;
+  delete[] MnmRe;
+  delete[] MnmIm;
+  delete[] LnmRe;
+  delete[] LnmIm;
+
+  for( jj=0; jj<numBoxIndex; jj++ ) {
+    jb = jj+levelOffset[numLevel-1];
+    for( v=0; v<numVectors; v++ ) {
+      for( j=0; j<numCoefficients; j++ ) {
+        Mnm[jb*numVectors+v][j] = 0;
+      }
+    }
+  }
+}
+
+// l2l
+void FmmKernel::l2l(int numBoxIndex, int numLevel) {
+  int numBoxIndexOld,ii,ib,i,nfic,j,k,jks,n,nks,v;
+  double *LnmVector;
+  std::complex<double> *LnmScalar,l2lScalar;
+  LnmVector = new double [2*numCoefficients*numVectors];
+  LnmScalar = new std::complex<double> [numVectors];
+
+  numBoxIndexOld = numBoxIndex;
+  if( numBoxIndexOld < 8 ) numBoxIndexOld = 8;
+  for( ii=0; ii<numBoxIndexOld*numVectors; ii++ ) {
+    for( i=0; i<numCoefficients; i++ ) {
+      LnmOld[ii][i] = Lnm[ii][i];
+    }
+  }
+
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    ib = ii+levelOffset[numLevel-1];
+    nfic = boxIndexFull[ib]%8;
+    ib = boxParent[ib]-levelOffset[numLevel-2];
+    for( n=0; n<numExpansions; n++ ) {
+      for( k=0; k<=n; k++ ) {
+        nks = n*(n+1)/2+k;
+        for( v=0; v<numVectors; v++ ) {
+          LnmVector[(2*nks+0)*numVectors+v] = real(LnmOld[ib*numVectors+v][nks]);
+          LnmVector[(2*nks+1)*numVectors+v] = imag(LnmOld[ib*numVectors+v][nks]);
+        }
+      }
+    }
+// Degree j of the child only sees degrees >= j of the parent
+    for( j=0; j<numExpansions; j++ ) {
+      for( k=0; k<=j; k++ ) {
+        jks = j*(j+1)/2+k;
+        for( v=0; v<numVectors; v++ ) LnmScalar[v] = 0;
+        for( i=j*(j+1); i<2*numCoefficients; i++ ) {
+          l2lScalar = l2lOperator[nfic][jks][i];
+          for( v=0; v<numVectors; v++ ) {
+            LnmScalar[v] += l2lScalar*LnmVector[i*numVectors+v];
+          }
+        }
+        for( v=0; v<numVectors; v++ ) Lnm[ii*numVectors+v][jks] = LnmScalar[v];
+      }
+    }
+  }
+  delete[] LnmVector;
+  delete[] LnmScalar;
+}
+
+// l2p
+void FmmKernel::l2p(int numBoxIndex) {
+  int ii,i,ibase,iend,l,n,m,nms,nm1,v;
+  vec3<float> boxCenter,*accel;
+  double boxSize,invBoxSize;
+  double dx[simdLanes],dy[simdLanes],dz[simdLanes];
+  double accelX[simdLanes],accelY[simdLanes],accelZ[simdLanes],potential[simdLanes];
+  double Rre[numCoefficients][simdLanes],Rim[numCoefficients][simdLanes];
+  double (*LnmRe)[numCoefficients],(*LnmIm)[numCoefficients];
+  LnmRe = new double [numVectors][numCoefficients];
+  LnmIm = new double [numVectors][numCoefficients];
+  accel = bodyWeights ? sortedAccelMulti : bodyAccel;
+
+  boxSize = rootBoxSize/(1 << maxLevel);
+  invBoxSize = 1/boxSize;
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    boxCenter = boxCenterFull[ii];
+// Lnm*s^(n+1)*(rho/s)^n*Ynm = Lnm*solidNorm*Rnm(dist/s), and the gradient picks up 1/s^2
+    for( v=0; v<numVectors; v++ ) {
+      for( i=0; i<numCoefficients; i++ ) {
+        LnmRe[v][i] = solidNorm[i]*real(Lnm[ii*numVectors+v][i]);
+        LnmIm[v][i] = solidNorm[i]*imag(Lnm[ii*numVectors+v][i]);
+      }
+    }
+    for( ibase=particleOffset[0][ii]; ibase<=particleOffset[1][ii]; ibase+=simdLanes ) {
+      iend = std::min(ibase+simdLanes-1,particleOffset[1][ii]);
+// Gather a batch of particles, padding the remainder with copies of the last one
+      for( l=0; l<simdLanes; l++ ) {
+        i = std::min(ibase+l,iend);
+        dx[l] = (bodyPos[i].x-boxCenter.x)*invBoxSize;
+        dy[l] = (bodyPos[i].y-boxCenter.y)*invBoxSize;
+        dz[l] = (bodyPos[i].z-boxCenter.z)*invBoxSize;
+      }
+      cart2reg(Rre,Rim,dx,dy,dz,numExpansions);
+// The harmonics of the batch are shared by the local expansions of every vector
+      for( v=0; v<numVectors; v++ ) {
+        for( l=0; l<simdLanes; l++ ) {
+          accelX[l] = 0;
+          accelY[l] = 0;
+          accelZ[l] = 0;
+          potential[l] = 0;
+        }
+// Gradient from d/dz Rnm = Rn-1m and (d/dx+I*d/dy) Rnm = Rn-1m+1, accumulated as (x+I*y, z)
+// The potential is the real part of the expansion itself and picks up 1/s
+        for( n=0; n<numExpansions; n++ ) {
+          for( m=0; m<=n; m++ ) {
+            nms = n*(n+1)/2+m;
+            for( l=0; l<simdLanes; l++ ) {
+              potential[l] += (m == 0 ? 1 : 2)*(LnmRe[v][nms]*Rre[nms][l]-LnmIm[v][nms]*Rim[nms][l]);
+            }
+            if( m <= n-2 ) {
+              nm1 = (n-1)*n/2+m+1;
+              for( l=0; l<simdLanes; l++ ) {
+                accelX[l] += LnmRe[v][nms]*Rre[nm1][l]-LnmIm[v][nms]*Rim[nm1][l];
+                accelY[l] += LnmRe[v][nms]*Rim[nm1][l]+LnmIm[v][nms]*Rre[nm1][l];
+              }
+            }
+            if( m >= 1 ) {
+              nm1 = (n-1)*n/2+m-1;
+              for( l=0; l<simdLanes; l++ ) {
+                accelX[l] -= LnmRe[v][nms]*Rre[nm1][l]-LnmIm[v][nms]*Rim[nm1][l];
+                accelY[l] += LnmRe[v][nms]*Rim[nm1][l]+LnmIm[v][nms]*Rre[nm1][l];
+              }
+            }
+            if( m <= n-1 ) {
+              nm1 = (n-1)*n/2+m;
+              for( l=0; l<simdLanes; l++ ) {
+                accelZ[l] += (m == 0 ? 1 : 2)*(LnmRe[v][nms]*Rre[nm1][l]-LnmIm[v][nms]*Rim[nm1][l]);
+              }
+            }
+          }
+        }
+        for( l=0; l<=iend-ibase; l++ ) {
+          i = ibase+l;
+          accel[i*numVectors+v].x += inv4PI*invBoxSize*invBoxSize*accelX[l];
+          accel[i*numVectors+v].y += inv4PI*invBoxSize*invBoxSize*accelY[l];
+          accel[i*numVectors+v].z += inv4PI*invBoxSize*invBoxSize*accelZ[l];
+          if( bodyPotential ) bodyPotential[i] += inv4PI*invBoxSize*potential[l];
+        }
+      }
+    }
+  }
+  delete[] LnmRe;
+  delete[] LnmIm;
+}
+
+// m2p
+void FmmKernel::m2p(int numBoxIndex, int numLevel) {
+  int ii,i,ibase,iend,ij,jj,jb,j,l,n,m,nms,nm1,v,interactionList[maxM2LInteraction];
+  double MnmReScalar,MnmImScalar;
+  vec3<float> boxCenter[maxM2LInteraction],*accel;
+  double boxSize,invBoxSize;
+  double dx[simdLanes],dy[simdLanes],dz[simdLanes];
+  double accelXs[simdLanes],accelYs[simdLanes],accelZs[simdLanes],potentials[simdLanes];
+  double Ire[numCoefficients+numExpansions+1][simdLanes],Iim[numCoefficients+numExpansions+1][simdLanes];
+  double (*accelX)[simdLanes],(*accelY)[simdLanes],(*accelZ)[simdLanes],(*potential)[simdLanes];
+  double (*MnmRe)[numCoefficients],(*MnmIm)[numCoefficients];
+  accel = bodyWeights ? sortedAccelMulti : bodyAccel;
+
+  boxSize = rootBoxSize/(1 << numLevel);
+  invBoxSize = 1/boxSize;
+// Target boxes are independent, so they are spread over threads, each with buffers for numVectors expansions
+#pragma omp parallel private(ii,i,ibase,iend,ij,jj,jb,j,l,n,m,nms,nm1,v,MnmReScalar,MnmImScalar,interactionList,boxCenter,dx,dy,dz,accelXs,accelYs,accelZs,potentials,Ire,Iim,accelX,accelY,accelZ,potential,MnmRe,MnmIm)
+  {
+  accelX = new double [numVectors][simdLanes];
+  accelY = new double [numVectors][simdLanes];
+  accelZ = new double [numVectors][simdLanes];
+  potential = new double [numVectors][simdLanes];
+  MnmRe = new double [maxM2LInteraction*numVectors][numCoefficients];
+  MnmIm = new double [maxM2LInteraction*numVectors][numCoefficients];
+#pragma omp for schedule(dynamic)
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+// Mnm/s^n*Ynm*(s/rho)^(n+1) = Mnm/solidNorm*Inm(dist/s), and the gradient picks up 1/s^2
+// The sources are converted once per target box and reused by every batch of its particles
+    tree.getInteractionListOfBox(ii,numLevel,interactionList);
+    for( ij=0; ij<numInteraction[ii]; ij++ ) {
+      jj = interactionList[ij];
+      jb = jj+levelOffset[numLevel-1];
+      for( v=0; v<numVectors; v++ ) {
+        for( j=0; j<numCoefficients; j++ ) {
+          MnmRe[ij*numVectors+v][j] = real(Mnm[jb*numVectors+v][j])/solidNorm[j];
+          MnmIm[ij*numVectors+v][j] = imag(Mnm[jb*numVectors+v][j])/solidNorm[j];
+        }
+      }
+      boxCenter[ij] = boxCenterFull[jb];
+    }
+    for( ibase=particleOffset[0][ii]; ibase<=particleOffset[1][ii]; ibase+=simdLanes ) {
+      iend = std::min(ibase+simdLanes-1,particleOffset[1][ii]);
+      for( v=0; v<numVectors; v++ ) {
+        for( l=0; l<simdLanes; l++ ) {
+          accelX[v][l] = 0;
+          accelY[v][l] = 0;
+          accelZ[v][l] = 0;
+          potential[v][l] = 0;
+        }
+      }
+      for( ij=0; ij<numInteraction[ii]; ij++ ) {
+        for( l=0; l<simdLanes; l++ ) {
+          i = std::min(ibase+l,iend);
+          dx[l] = (bodyPos[i].x-boxCenter[ij].x)*invBoxSize;
+          dy[l] = (bodyPos[i].y-boxCenter[ij].y)*invBoxSize;
+          dz[l] = (bodyPos[i].z-boxCenter[ij].z)*invBoxSize;
+        }
+        cart2irr(Ire,Iim,dx,dy,dz,numExpansions+1);
+// Gradient from d/dz Inm = -In+1m and (d/dx+I*d/dy) Inm = In+1m+1, accumulated as (x+I*y, z)
+// The harmonics of the batch are shared by the multipoles of every vector
+        for( v=0; v<numVectors; v++ ) {
+          jb = ij*numVectors+v;
+          for( l=0; l<simdLanes; l++ ) {
+            accelXs[l] = 0;
+            accelYs[l] = 0;
+            accelZs[l] = 0;
+            potentials[l] = 0;
+          }
+          for( n=0; n<numExpansions; n++ ) {
+            for( m=0; m<=n; m++ ) {
+              nms = n*(n+1)/2+m;
+              MnmReScalar = MnmRe[jb][nms];
+              MnmImScalar = MnmIm[jb][nms];
+              for( l=0; l<simdLanes; l++ ) {
+                potentials[l] += (m == 0 ? 1 : 2)*(MnmReScalar*Ire[nms][l]-MnmImScalar*Iim[nms][l]);
+              }
+              nm1 = (n+1)*(n+2)/2+m+1;
+              for( l=0; l<simdLanes; l++ ) {
+                accelXs[l] += MnmReScalar*Ire[nm1][l]-MnmImScalar*Iim[nm1][l];
+                accelYs[l] += MnmReScalar*Iim[nm1][l]+MnmImScalar*Ire[nm1][l];
+              }
+              if( m >= 1 ) {
+                nm1 = (n+1)*(n+2)/2+m-1;
+                for( l=0; l<simdLanes; l++ ) {
+                  accelXs[l] -= MnmReScalar*Ire[nm1][l]-MnmImScalar*Iim[nm1][l];
+                  accelYs[l] += MnmReScalar*Iim[nm1][l]+MnmImScalar*Ire[nm1][l];
+                }
+              }
+              nm1 = (n+1)*(n+2)/2+m;
+              for( l=0; l<simdLanes; l++ ) {
+                accelZs[l] -= (m == 0 ? 1 : 2)*(MnmReScalar*Ire[nm1][l]-MnmImScalar*Iim[nm1][l]);
+              }
+            }
+          }
+          for( l=0; l<simdLanes; l++ ) {
+            accelX[v][l] += accelXs[l];
+            accelY[v][l] += accelYs[l];
+            accelZ[v][l] += accelZs[l];
+            potential[v][l] += potentials[l];
+          }
+        }
+      }
+      for( v=0; v<numVectors; v++ ) {
+        for( l=0; l<=iend-ibase; l++ ) {
+          i = ibase+l;
+          accel[i*numVectors+v].x += inv4PI*invBoxSize*invBoxSize*accelX[v][l];
+          accel[i*numVectors+v].y += inv4PI*invBoxSize*invBoxSize*accelY[v][l];
+          accel[i*numVectors+v].z += inv4PI*invBoxSize*invBoxSize*accelZ[v][l];
+          if( bodyPotential ) bodyPotential[i] += inv4PI*invBoxSize*potential[v][l];
+        }
+      }
+    }
+  }
+  delete[] accelX;
+  delete[] accelY;
+  delete[] accelZ;
+  delete[] potential;
+  delete[] MnmRe;
+  delete[] MnmIm;
+  }
+}
@@ -1,4 +1,16 @@
 #include "fmm.h"
+#include <omp.h>
+#include <algorithm>
+
+// Spread the lower 10 bits of n to every third bit, for interleaving the Morton index
+inline int dilate3(int n) {
+  n &= 0x000003ff;
+  n = (n | n << 16) & 0x030000ff;
+  n = (n | n << 8) & 0x0300f00f;
+  n = (n | n << 4) & 0x030c30c3;
+  n = (n | n << 2) & 0x09249249;
+  return n;
+}
 
 // Dynamically allocate memory for non-empty boxes
 void FmmSystem::allocate() {
@@ -8,16 +20,21 @@ void FmmSystem::allocate() {
   for( i=0; i<2; i++ ) particleOffset[i] = new int [numBoxIndexLeaf];
   boxIndexMask = new int [numBoxIndexFull];
   boxIndexFull = new int [numBoxIndexTotal];
+  boxIndex3DFull = new vec3<int> [numBoxIndexTotal];
+  boxCenterFull = new vec3<float> [numBoxIndexTotal];
+  boxParent = new int [numBoxIndexTotal];
+  boxChildStart = new int [numBoxIndexTotal];
+  boxChildEnd = new int [numBoxIndexTotal];
   levelOffset = new int [maxLevel];
   numInteraction = new int [numBoxIndexLeaf];
-  interactionList = new int [numBoxIndexLeaf][maxM2LInteraction];
+  interactionMask = new unsigned int [numBoxIndexLeaf][numStencilWords];
   boxOffsetStart = new int [numBoxIndexLeaf];
   boxOffsetEnd = new int [numBoxIndexLeaf];
 
   factorial = new float [4*numExpansion2];
-  Lnm = new std::complex<double> [numBoxIndexLeaf][numCoefficients];
-  LnmOld = new std::complex<double> [numBoxIndexLeaf][numCoefficients];
-  Mnm = new std::complex<double> [numBoxIndexTotal][numCoefficients];
+  Lnm = new std::complex<double> [numBoxIndexLeaf*numVectors][numCoefficients];
+  LnmOld = new std::complex<double> [numBoxIndexLeaf*numVectors][numCoefficients];
+  Mnm = new std::complex<double> [numBoxIndexTotal*numVectors][numCoefficients];
   Ynm = new std::complex<double> [4*numExpansion2];
   Dnm = new std::complex<double>** [2*numRelativeBox];
   for( i=0; i<2*numRelativeBox; i++ ) {
@@ -34,9 +51,14 @@ void FmmSystem::deallocate() {
   delete[] particleOffset;
   delete[] boxIndexMask;
   delete[] boxIndexFull;
+  delete[] boxIndex3DFull;
+  delete[] boxCenterFull;
+  delete[] boxParent;
+  delete[] boxChildStart;
+  delete[] boxChildEnd;
   delete[] levelOffset;
   delete[] numInteraction;
-  delete[] interactionList;
+  delete[] interactionMask;
   delete[] boxOffsetStart;
   delete[] boxOffsetEnd;
   delete[] mortonIndex;
@@ -57,6 +79,35 @@ void FmmSystem::deallocate() {
   delete[] Dnm;
 }
 
+// Reuse the leaves of the previous call while no particle moved more than verletSkin leaf widths since the
+// tree was built, so particles may sit slightly outside their leaf
+// Only Barnes-Hut opens boxes by their drifted radii at every level, the other modes cap the skin at maxVerletSkin
+void FmmSystem::checkVerletSkin(int numParticles, int treeOrFMM) {
+  int i;
+  float dx,dy,dz,skin;
+
+  treeReused = 0;
+  maxDisplacement = 0;
+  if( !keepSorted || verletSkin <= 0 ) return;
+  if( bodyPosBuild != NULL && bodyKey != NULL && numBodyKey == numParticles ) {
+    for( i=0; i<numParticles; i++ ) {
+      dx = bodyPos[i].x-bodyPosBuild[i].x;
+      dy = bodyPos[i].y-bodyPosBuild[i].y;
+      dz = bodyPos[i].z-bodyPosBuild[i].z;
+      maxDisplacement = std::max(maxDisplacement,dx*dx+dy*dy+dz*dz);
+    }
+    maxDisplacement = sqrtf(maxDisplacement);
+    skin = treeOrFMM == 2 ? verletSkin : std::min(verletSkin,maxVerletSkin);
+    if( maxDisplacement < skin*rootBoxSize/(1 << maxLevel) ) {
+      treeReused = 1;
+      numTreeReuse++;
+      return;
+    }
+  }
+  maxDisplacement = 0;
+  numTreeBuild++;
+}
+
 // Calculate range of FMM domain from particle positions
 void FmmSystem::setDomainSize(int numParticles) {
   int i;
@@ -69,7 +120,8 @@ void FmmSystem::setDomainSize(int numParticles) {
   ymax = -1000000;
   zmin = 1000000;
   zmax = -1000000;
-// Calculate the minimum and maximum of particle positions
+// Calculate the minimum and maximum of particle positions, as a vectorizable parallel reduction
+#pragma omp parallel for reduction(min:xmin,ymin,zmin) reduction(max:xmax,ymax,zmax)
   for( i=0; i<numParticles; i++ ) {
     xmin = std::min(xmin,bodyPos[i].x);
     xmax = std::max(xmax,bodyPos[i].x);
@@ -78,6 +130,19 @@ void FmmSystem::setDomainSize(int numParticles) {
     zmin = std::min(zmin,bodyPos[i].z);
     zmax = std::max(zmax,bodyPos[i].z);
   }
+  boxExtent.x = xmax-xmin;
+  boxExtent.y = ymax-ymin;
+  boxExtent.z = zmax-zmin;
+// Particles in one plane z = planeHeight are solved with the box centers in that plane
+  planeHeight = 0.5f*(zmin+zmax);
+  planarSystem = boxExtent.z <= planarTolerance*std::max(boxExtent.x,boxExtent.y);
+// Keep the previous domain while it still encloses the particles, so particles that stay in their leaf keep their key
+  if( keepSorted && bodyKey != NULL && numBodyKey == numParticles &&
+      boxMin.x <= xmin && xmax < boxMin.x+rootBoxSize &&
+      boxMin.y <= ymin && ymax < boxMin.y+rootBoxSize &&
+      boxMin.z <= zmin && zmax < boxMin.z+rootBoxSize &&
+      (!planarSystem || zmax-boxMin.z <= planarTolerance*rootBoxSize) &&
+      2*std::max(xmax-xmin,std::max(ymax-ymin,zmax-zmin)) > rootBoxSize ) return;
   boxMin.x = xmin;
   boxMin.y = ymin;
   boxMin.z = zmin;
@@ -90,7 +155,12 @@ void FmmSystem::setDomainSize(int numParticles) {
 }
 
 // Calculate leaf level optimally from tabulated theshold values of numParticles
+// Thin or elongated particle sets leave most leaves empty, so the level is raised until the leaves occupied
+// according to boxExtent are at least half as many as the table intends, like a quadtree refinement of a disk
 void FmmSystem::setOptimumLevel(int numParticles) {
+  int numLevel,numLeaf,numLeafTarget;
+  numLevel = maxLevel;
+
 //  float level_switch[6]={2e4,1.7e5,1.3e6,1e7,7e7,5e8}; // cpu-tree
 //  float level_switch[6]={1.3e4,1e5,7e5,5e6,3e7,1.5e8}; // cpu-fmm
 //  float level_switch[6]={1e5,5e5,5e6,3e7,2e8,1.5e9}; // gpu-tree
@@ -112,35 +182,81 @@ void FmmSystem::setOptimumLevel(int numParticles) {
   } else {
     maxLevel += 7;
   }
+  numLeafTarget = 1 << 3*maxLevel;
+  for( ; maxLevel<8; maxLevel++ ) {
+    numLeaf = 1;
+    numLeaf *= std::min(1 << maxLevel,int(boxExtent.x/rootBoxSize*(1 << maxLevel))+1);
+    numLeaf *= std::min(1 << maxLevel,int(boxExtent.y/rootBoxSize*(1 << maxLevel))+1);
+    numLeaf *= std::min(1 << maxLevel,int(boxExtent.z/rootBoxSize*(1 << maxLevel))+1);
+    if( 2*numLeaf >= numLeafTarget ) break;
+  }
+// Keys of another level cannot be compared with the new ones
+  if( maxLevel != numLevel ) numBodyKey = 0;
   printf("level  : %d\n",maxLevel);
   numBoxIndexFull = 1 << 3*maxLevel;
 }
 
 // Generate Morton index from particle coordinates
+// The coordinates are quantized by a multiply with the inverse leaf size and interleaved without a loop over levels
 void FmmSystem::morton(int numParticles) {
-  int i,j,nx,ny,nz,boxIndex;
-  float boxSize;
-  boxSize = rootBoxSize/(1 << maxLevel);
+  int j,nx,ny,nz,numBox;
+  float boxSizeInv;
+  boxSizeInv = (1 << maxLevel)/rootBoxSize;
+  numBox = 1 << maxLevel;
 
+#pragma omp parallel for private(nx,ny,nz)
   for( j=0; j<numParticles; j++ ) {
-    nx = int((bodyPos[j].x-boxMin.x)/boxSize);
-    ny = int((bodyPos[j].y-boxMin.y)/boxSize);
-    nz = int((bodyPos[j].z-boxMin.z)/boxSize);
-    if( nx >= (1 << maxLevel) ) nx--;
-    if( ny >= (1 << maxLevel) ) ny--;
-    if( nz >= (1 << maxLevel) ) nz--;
-    boxIndex = 0;
-    for( i=0; i<maxLevel; i++ ) {
-      boxIndex += nx%2 << (3*i+1);
-      nx >>= 1;
+    nx = int((bodyPos[j].x-boxMin.x)*boxSizeInv);
+    ny = int((bodyPos[j].y-boxMin.y)*boxSizeInv);
+    nz = int((bodyPos[j].z-boxMin.z)*boxSizeInv);
+    nx = std::min(nx,numBox-1);
+    ny = std::min(ny,numBox-1);
+    nz = std::min(nz,numBox-1);
+    mortonIndex[j] = dilate3(nx) << 1 | dilate3(ny) | dilate3(nz) << 2;
+  }
+}
 
-      boxIndex += ny%2 << (3*i);
-      ny >>= 1;
+// Generate Hilbert index from particle coordinates into sortValue, using Skilling's transform of the axes
+// A box at any level is still a contiguous run of keys, so boxes are enumerated in Hilbert order
+// while keeping their Morton index in boxIndexFull
+void FmmSystem::hilbert(int numParticles) {
+  int i,j,k,q,p,boxIndex,index3D[3];
+  float boxSizeInv;
+  boxSizeInv = (1 << maxLevel)/rootBoxSize;
 
-      boxIndex += nz%2 << (3*i+2);
-      nz >>= 1;
+#pragma omp parallel for private(i,k,q,p,boxIndex,index3D)
+  for( j=0; j<numParticles; j++ ) {
+    index3D[0] = int((bodyPos[j].x-boxMin.x)*boxSizeInv);
+    index3D[1] = int((bodyPos[j].y-boxMin.y)*boxSizeInv);
+    index3D[2] = int((bodyPos[j].z-boxMin.z)*boxSizeInv);
+    for( i=0; i<3; i++ ) {
+      index3D[i] = std::min(index3D[i],(1 << maxLevel)-1);
+    }
+// Undo the excess work of the Gray code level by level
+    for( q=1 << (maxLevel-1); q>1; q>>=1 ) {
+      p = q-1;
+      for( i=0; i<3; i++ ) {
+        if( index3D[i] & q ) {
+          index3D[0] ^= p;
+        } else {
+          k = (index3D[0]^index3D[i]) & p;
+          index3D[0] ^= k;
+          index3D[i] ^= k;
+        }
+      }
+    }
+// Gray encode
+    for( i=1; i<3; i++ ) index3D[i] ^= index3D[i-1];
+    k = 0;
+    for( q=1 << (maxLevel-1); q>1; q>>=1 ) {
+      if( index3D[2] & q ) k ^= q-1;
+    }
+    for( i=0; i<3; i++ ) index3D[i] ^= k;
+    boxIndex = 0;
+    for( i=maxLevel-1; i>=0; i-- ) {
+      boxIndex = (boxIndex << 3)+((index3D[0] >> i & 1) << 2)+((index3D[1] >> i & 1) << 1)+(index3D[2] >> i & 1);
     }
-    mortonIndex[j] = boxIndex;
+    sortValue[j] = boxIndex;
   }
 }
 
@@ -199,19 +315,95 @@ void FmmSystem::sort(int numParticles) {
 }
 
 // Sort the particles according to the previously sorted Morton index
+// When keepSorted is set the particles are still in the order of the previous call, so only the particles
+// whose key changed are sorted and merged into the rest, and bodyVel and bodyIndex (if allocated) move with bodyPos
 void FmmSystem::sortParticles(int& numParticles) {
-  int i;
+  int i,j,k,numStay;
 
   permutation = new int [numParticles];
 
+// Within the Verlet skin the particles keep the leaves of the previous call
+  if( treeReused ) {
+    for( i=0; i<numParticles; i++ ) {
+      permutation[i] = i;
+      mortonIndex[i] = bodyKey[i];
+    }
+    numMovedParticles = 0;
+    return;
+  }
   morton(numParticles);
   for( i=0; i<numParticles; i++ ) {
     sortValue[i] = mortonIndex[i];
     sortIndex[i] = i;
   }
-  sort(numParticles);
-  for( i=0; i<numParticles; i++ ) {
-    permutation[i] = sortIndex[i];
+  if( curveType == 1 ) hilbert(numParticles);
+  numMovedParticles = numParticles;
+  if( keepSorted && bodyKey != NULL && numBodyKey == numParticles ) {
+    numMovedParticles = 0;
+    for( i=0; i<numParticles; i++ ) {
+      if( mortonIndex[i] != bodyKey[i] ) numMovedParticles++;
+    }
+    if( numMovedParticles == 0 ) {
+      for( i=0; i<numParticles; i++ ) permutation[i] = i;
+      return;
+    }
+  } else if( keepSorted ) {
+    for( i=1; i<numParticles; i++ ) {
+      if( sortValue[i-1] > sortValue[i] ) break;
+    }
+    if( i >= numParticles ) numMovedParticles = -1;
+  }
+  if( numMovedParticles < 0 ) {
+    for( i=0; i<numParticles; i++ ) permutation[i] = i;
+    numMovedParticles = numParticles;
+  } else if( numMovedParticles < numParticles && numMovedParticles*numMovedParticles < 16*numParticles ) {
+// The particles that kept their key are still sorted, so insertion sort the moved ones and merge the two runs
+    numStay = numParticles-numMovedParticles;
+    j = 0;
+    k = numStay;
+    for( i=0; i<numParticles; i++ ) {
+      if( mortonIndex[i] == bodyKey[i] ) {
+        sortIndex[j] = i;
+        j++;
+      } else {
+        sortIndex[k] = i;
+        k++;
+      }
+    }
+    for( i=numStay+1; i<numParticles; i++ ) {
+      k = sortIndex[i];
+      for( j=i-1; j>=numStay && sortValue[sortIndex[j]] > sortValue[k]; j-- ) sortIndex[j+1] = sortIndex[j];
+      sortIndex[j+1] = k;
+    }
+    i = 0;
+    j = numStay;
+    for( k=0; k<numParticles; k++ ) {
+      if( j >= numParticles || (i < numStay && sortValue[sortIndex[i]] <= sortValue[sortIndex[j]]) ) {
+        permutation[k] = sortIndex[i];
+        i++;
+      } else {
+        permutation[k] = sortIndex[j];
+        j++;
+      }
+    }
+    for( i=0; i<numParticles; i++ ) sortValueBuffer[i] = sortValue[permutation[i]];
+    for( i=0; i<numParticles; i++ ) sortValue[i] = sortValueBuffer[i];
+  } else {
+    sort(numParticles);
+    for( i=0; i<numParticles; i++ ) {
+      permutation[i] = sortIndex[i];
+    }
+  }
+  for( i=0; i<numParticles; i++ ) sortIndexBuffer[i] = mortonIndex[permutation[i]];
+  for( i=0; i<numParticles; i++ ) mortonIndex[i] = sortIndexBuffer[i];
+// Remember the leaf of each particle to detect the moved particles in the next call
+  if( keepSorted ) {
+    if( numBodyKey != numParticles ) {
+      delete[] bodyKey;
+      bodyKey = new int [numParticles];
+      numBodyKey = numParticles;
+    }
+    for( i=0; i<numParticles; i++ ) bodyKey[i] = mortonIndex[i];
   }
 
   vec4<float> *sortBuffer;
@@ -223,11 +415,38 @@ void FmmSystem::sortParticles(int& numParticles) {
     bodyPos[i] = sortBuffer[i];
   }
   delete[] sortBuffer;
+  if( keepSorted && bodyVel != NULL ) {
+    vec3<float> *sortBuffer3;
+    sortBuffer3 = new vec3<float> [numParticles];
+    for( i=0; i<numParticles; i++ ) {
+      sortBuffer3[i] = bodyVel[permutation[i]];
+    }
+    for( i=0; i<numParticles; i++ ) {
+      bodyVel[i] = sortBuffer3[i];
+    }
+    delete[] sortBuffer3;
+  }
+  if( keepSorted && bodyIndex != NULL ) {
+    int *sortBuffer1;
+    sortBuffer1 = new int [numParticles];
+    for( i=0; i<numParticles; i++ ) {
+      sortBuffer1[i] = bodyIndex[permutation[i]];
+    }
+    for( i=0; i<numParticles; i++ ) {
+      bodyIndex[i] = sortBuffer1[i];
+    }
+    delete[] sortBuffer1;
+  }
 }
 
-// Unsorting particles upon exit (optional)
+// Unsorting particles upon exit (optional), skipped when the particles are kept in tree order
 void FmmSystem::unsortParticles(int& numParticles) {
   int i;
+
+  if( keepSorted ) {
+    delete[] permutation;
+    return;
+  }
   vec3<float> *sortBuffer;
   sortBuffer = new vec3<float> [numParticles];
   for( i=0; i<numParticles; i++ ) {
@@ -237,6 +456,17 @@ void FmmSystem::unsortParticles(int& numParticles) {
     bodyAccel[i] = sortBuffer[i];
   }
   delete[] sortBuffer;
+  if( bodyPotential ) {
+    float *potentialBuffer;
+    potentialBuffer = new float [numParticles];
+    for( i=0; i<numParticles; i++ ) {
+      potentialBuffer[permutation[i]] = bodyPotential[i];
+    }
+    for( i=0; i<numParticles; i++ ) {
+      bodyPotential[i] = potentialBuffer[i];
+    }
+    delete[] potentialBuffer;
+  }
   vec4<float> *sortBuffer2;
   sortBuffer2 = new vec4<float> [numParticles];
   for( i=0; i<numParticles; i++ ) {
@@ -250,44 +480,45 @@ void FmmSystem::unsortParticles(int& numParticles) {
 }
 
 // Estimate storage requirements adaptively to skip empty boxes
+// sortValue still holds the sorted keys from sortParticles
 void FmmSystem::countNonEmptyBoxes(int numParticles) {
-  int i,currentIndex,numLevel;
+  int i,currentIndex,numLevel,numBoxIndex,numBoxIndexOld;
 
-  morton(numParticles);
-  for( i=0; i<numParticles; i++ ) {
-    sortValue[i] = mortonIndex[i];
-    sortIndex[i] = i;
-  }
-  sort(numParticles);
-
-// Count non-empty boxes at leaf level
+// Count non-empty boxes at leaf level, keeping their keys in sortValueBuffer
   numBoxIndexLeaf = 0; // counter
   currentIndex = -1;
   for( i=0; i<numParticles; i++ ) {
     if( sortValue[i] != currentIndex ) {
-      numBoxIndexLeaf++;
       currentIndex = sortValue[i];
+      sortValueBuffer[numBoxIndexLeaf] = currentIndex;
+      numBoxIndexLeaf++;
     }
   }
 
-// Count non-empty boxes for all levels
+// Count non-empty boxes for all levels by compacting the keys of the level below in place
   numBoxIndexTotal = numBoxIndexLeaf;
+  numBoxIndex = numBoxIndexLeaf;
   for( numLevel=maxLevel-1; numLevel>=2; numLevel-- ) {
+    numBoxIndexOld = numBoxIndex;
+    numBoxIndex = 0;
     currentIndex = -1;
-    for( i=0; i<numParticles; i++ ) {
-      if( sortValue[i]/(1 << 3*(maxLevel-numLevel)) != currentIndex ) {
-        numBoxIndexTotal++;
-        currentIndex = sortValue[i]/(1 << 3*(maxLevel-numLevel));
+    for( i=0; i<numBoxIndexOld; i++ ) {
+      if( sortValueBuffer[i]/8 != currentIndex ) {
+        currentIndex = sortValueBuffer[i]/8;
+        sortValueBuffer[numBoxIndex] = currentIndex;
+        numBoxIndex++;
       }
     }
+    numBoxIndexTotal += numBoxIndex;
   }
 }
 
 // Obtain two-way link list between non-empty and full box indices, and offset of particle index
+// mortonIndex is left in tree order by sortParticles
+// The 3D index and center of each leaf go into the box table so the kernels do not decode them again
 void FmmSystem::getBoxData(int numParticles, int& numBoxIndex) {
   int i,currentIndex;
-
-  morton(numParticles);
+  double boxSize;
 
   numBoxIndex = 0;
   currentIndex = -1;
@@ -303,36 +534,60 @@ void FmmSystem::getBoxData(int numParticles, int& numBoxIndex) {
     }
   }
   particleOffset[1][numBoxIndex-1] = numParticles-1;
+  boxSize = rootBoxSize/(1 << maxLevel);
+  for( i=0; i<numBoxIndex; i++ ) {
+    unmorton(boxIndexFull[i],boxIndex3DFull[i]);
+    boxCenterFull[i].x = boxMin.x+(boxIndex3DFull[i].x+0.5)*boxSize;
+    boxCenterFull[i].y = boxMin.y+(boxIndex3DFull[i].y+0.5)*boxSize;
+    boxCenterFull[i].z = planarSystem ? planeHeight : boxMin.z+(boxIndex3DFull[i].z+0.5)*boxSize;
+    boxParent[i] = -1;
+    boxChildStart[i] = 0;
+    boxChildEnd[i] = 0;
+  }
 }
 
-// Propagate non-empty/full link list to parent boxes
+// Propagate non-empty/full link list to parent boxes, and link parents and children in the box table
 void FmmSystem::getBoxDataOfParent(int& numBoxIndex, int numLevel, int treeOrFMM) {
-  int i,numBoxIndexOld,currentIndex,boxIndex;
+  int i,numBoxIndexOld,currentIndex,boxIndex,parentIndex;
+  double boxSize;
+  boxSize = rootBoxSize/(1 << numLevel);
   levelOffset[numLevel-1] = levelOffset[numLevel]+numBoxIndex;
   numBoxIndexOld = numBoxIndex;
   numBoxIndex = 0;
   currentIndex = -1;
-  for( i=0; i<numBoxIndexFull; i++ ) boxIndexMask[i] = -1;
+  parentIndex = -1;
+  for( i=0; i<(1 << 3*numLevel); i++ ) boxIndexMask[i] = -1;
   for( i=0; i<numBoxIndexOld; i++ ) {
     boxIndex = i+levelOffset[numLevel];
     if( currentIndex != boxIndexFull[boxIndex]/8 ) {
       currentIndex = boxIndexFull[boxIndex]/8;
       boxIndexMask[currentIndex] = numBoxIndex;
-      boxIndexFull[numBoxIndex+levelOffset[numLevel-1]] = currentIndex;
+      parentIndex = numBoxIndex+levelOffset[numLevel-1];
+      boxIndexFull[parentIndex] = currentIndex;
+      boxIndex3DFull[parentIndex].x = boxIndex3DFull[boxIndex].x/2;
+      boxIndex3DFull[parentIndex].y = boxIndex3DFull[boxIndex].y/2;
+      boxIndex3DFull[parentIndex].z = boxIndex3DFull[boxIndex].z/2;
+      boxCenterFull[parentIndex].x = boxMin.x+(boxIndex3DFull[parentIndex].x+0.5)*boxSize;
+      boxCenterFull[parentIndex].y = boxMin.y+(boxIndex3DFull[parentIndex].y+0.5)*boxSize;
+      boxCenterFull[parentIndex].z = planarSystem ? planeHeight : boxMin.z+(boxIndex3DFull[parentIndex].z+0.5)*boxSize;
+      boxParent[parentIndex] = -1;
+      boxChildStart[parentIndex] = i;
       if( treeOrFMM == 0 ) {
         particleOffset[0][numBoxIndex] = particleOffset[0][i];
         if( numBoxIndex > 0 ) particleOffset[1][numBoxIndex-1] = particleOffset[0][i]-1;
       }
       numBoxIndex++;
     }
+    boxParent[boxIndex] = parentIndex;
+    boxChildEnd[parentIndex] = i+1;
   }
   if( treeOrFMM == 0 ) particleOffset[1][numBoxIndex-1] = particleOffset[1][numBoxIndexOld-1];
 }
 
-// Recalculate non-empty box index for current level
+// Recalculate non-empty box index for current level, only the boxes of this level need to be cleared
 void FmmSystem::getBoxIndexMask(int numBoxIndex, int numLevel) {
   int i,boxIndex;
-  for( i=0; i<numBoxIndexFull; i++ ) boxIndexMask[i] = -1;
+  for( i=0; i<(1 << 3*numLevel); i++ ) boxIndexMask[i] = -1;
   for( i=0; i<numBoxIndex; i++ ) {
     boxIndex = i+levelOffset[numLevel-1];
     boxIndexMask[boxIndexFull[boxIndex]] = i;
@@ -340,11 +595,18 @@ void FmmSystem::getBoxIndexMask(int numBoxIndex, int numLevel) {
 }
 
 // Calculate the interaction list for P2P and M2L
+// Each list is stored as a bit mask over the 6x6x6 children of the 27 neighbours of the parent, which holds
+// the P2P neighbours, the M2L/M2P stencil and all of level 2, and is expanded by getInteractionListOfBox
 void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactionType) {
-  int jxmin,jxmax,jymin,jymax,jzmin,jzmax,ii,ib,jj,jb,ix,iy,iz,jx,jy,jz,boxIndex;
-  int ixp,iyp,izp,jxp,jyp,jzp;
+  int jxmin,jxmax,jymin,jymax,jzmin,jzmax,i,ii,ib,jj,jb,ix,iy,iz,jx,jy,jz,boxIndex,bit,reach;
+  int ixp,iyp,izp,jxp,jyp,jzp,ix0,iy0,iz0;
   vec3<int> boxIndex3D;
 
+  interactionOffset = NULL;
+// Within the Verlet skin particles may sit outside their leaf, so P2P at the leaf level spans the 5x5x5 leaves
+// around each leaf and the leaf M2L/M2P lists start beyond them, as well separated as in the plain stencil
+  reach = numLevel == maxLevel && maxDisplacement > 0 ? 2 : 1;
+
 // Initialize the minimum and maximum values
   jxmin = 1000000;
   jxmax = -1000000;
@@ -355,7 +617,7 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
 // Calculate the minimum and maximum of boxIndex3D
   for( jj=0; jj<numBoxIndex; jj++ ) {
     jb = jj+levelOffset[numLevel-1];
-    unmorton(boxIndexFull[jb],boxIndex3D);
+    boxIndex3D = boxIndex3DFull[jb];
     jxmin = std::min(jxmin,boxIndex3D.x);
     jxmax = std::max(jxmax,boxIndex3D.x);
     jymin = std::min(jymin,boxIndex3D.y);
@@ -368,20 +630,24 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
     for( ii=0; ii<numBoxIndex; ii++ ) {
       ib = ii+levelOffset[numLevel-1];
       numInteraction[ii] = 0;
-      unmorton(boxIndexFull[ib],boxIndex3D);
+      for( i=0; i<numStencilWords; i++ ) interactionMask[ii][i] = 0;
+      boxIndex3D = boxIndex3DFull[ib];
       ix = boxIndex3D.x;
       iy = boxIndex3D.y;
       iz = boxIndex3D.z;
-      for( jx=std::max(ix-1,jxmin); jx<=std::min(ix+1,jxmax); jx++ ) {
-        for( jy=std::max(iy-1,jymin); jy<=std::min(iy+1,jymax); jy++ ) {
-          for( jz=std::max(iz-1,jzmin); jz<=std::min(iz+1,jzmax); jz++ ) {
+      ix0 = 2*((ix+2)/2)-4;
+      iy0 = 2*((iy+2)/2)-4;
+      iz0 = 2*((iz+2)/2)-4;
+      for( jx=std::max(ix-reach,jxmin); jx<=std::min(ix+reach,jxmax); jx++ ) {
+        for( jy=std::max(iy-reach,jymin); jy<=std::min(iy+reach,jymax); jy++ ) {
+          for( jz=std::max(iz-reach,jzmin); jz<=std::min(iz+reach,jzmax); jz++ ) {
             boxIndex3D.x = jx;
             boxIndex3D.y = jy;
             boxIndex3D.z = jz;
             morton1(boxIndex3D,boxIndex,numLevel);
-            jj = boxIndexMask[boxIndex];
-            if( jj != -1 ) {
-              interactionList[ii][numInteraction[ii]] = jj;
+            if( boxIndexMask[boxIndex] != -1 ) {
+              bit = ((jx-ix0)*6+jy-iy0)*6+jz-iz0;
+              interactionMask[ii][bit >> 5] |= 1u << (bit & 31);
               numInteraction[ii]++;
             }
           }
@@ -393,18 +659,23 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
     for( ii=0; ii<numBoxIndex; ii++ ) {
       ib = ii+levelOffset[numLevel-1];
       numInteraction[ii] = 0;
-      unmorton(boxIndexFull[ib],boxIndex3D);
+      for( i=0; i<numStencilWords; i++ ) interactionMask[ii][i] = 0;
+      boxIndex3D = boxIndex3DFull[ib];
       ix = boxIndex3D.x;
       iy = boxIndex3D.y;
       iz = boxIndex3D.z;
+      ix0 = 2*((ix+2)/2)-4;
+      iy0 = 2*((iy+2)/2)-4;
+      iz0 = 2*((iz+2)/2)-4;
       for( jj=0; jj<numBoxIndex; jj++ ) {
         jb = jj+levelOffset[numLevel-1];
-        unmorton(boxIndexFull[jb],boxIndex3D);
+        boxIndex3D = boxIndex3DFull[jb];
         jx = boxIndex3D.x;
         jy = boxIndex3D.y;
         jz = boxIndex3D.z;
-        if( jx < ix-1 || ix+1 < jx || jy < iy-1 || iy+1 < jy || jz < iz-1 || iz+1 < jz ) {
-          interactionList[ii][numInteraction[ii]] = jj;
+        if( jx < ix-reach || ix+reach < jx || jy < iy-reach || iy+reach < jy || jz < iz-reach || iz+reach < jz ) {
+          bit = ((jx-ix0)*6+jy-iy0)*6+jz-iz0;
+          interactionMask[ii][bit >> 5] |= 1u << (bit & 31);
           numInteraction[ii]++;
         }
       }
@@ -414,10 +685,14 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
     for( ii=0; ii<numBoxIndex; ii++ ) {
       ib = ii+levelOffset[numLevel-1];
       numInteraction[ii] = 0;
-      unmorton(boxIndexFull[ib],boxIndex3D);
+      for( i=0; i<numStencilWords; i++ ) interactionMask[ii][i] = 0;
+      boxIndex3D = boxIndex3DFull[ib];
       ix = boxIndex3D.x;
       iy = boxIndex3D.y;
       iz = boxIndex3D.z;
+      ix0 = 2*((ix+2)/2)-4;
+      iy0 = 2*((iy+2)/2)-4;
+      iz0 = 2*((iz+2)/2)-4;
       ixp = (ix+2)/2;
       iyp = (iy+2)/2;
       izp = (iz+2)/2;
@@ -427,14 +702,14 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
             for( jx=std::max(2*jxp-2,jxmin); jx<=std::min(2*jxp-1,jxmax); jx++ ) {
               for( jy=std::max(2*jyp-2,jymin); jy<=std::min(2*jyp-1,jymax); jy++ ) {
                 for( jz=std::max(2*jzp-2,jzmin); jz<=std::min(2*jzp-1,jzmax); jz++ ) {
-                  if( jx < ix-1 || ix+1 < jx || jy < iy-1 || iy+1 < jy || jz < iz-1 || iz+1 < jz ) {
+                  if( jx < ix-reach || ix+reach < jx || jy < iy-reach || iy+reach < jy || jz < iz-reach || iz+reach < jz ) {
                     boxIndex3D.x = jx;
                     boxIndex3D.y = jy;
                     boxIndex3D.z = jz;
                     morton1(boxIndex3D,boxIndex,numLevel);
-                    jj = boxIndexMask[boxIndex];
-                    if( jj != -1 ) {
-                      interactionList[ii][numInteraction[ii]] = jj;
+                    if( boxIndexMask[boxIndex] != -1 ) {
+                      bit = ((jx-ix0)*6+jy-iy0)*6+jz-iz0;
+                      interactionMask[ii][bit >> 5] |= 1u << (bit & 31);
                       numInteraction[ii]++;
                     }
                   }
@@ -448,52 +723,522 @@ void FmmSystem::getInteractionList(int numBoxIndex, int numLevel, int interactio
   }
 }
 
+// Relative offset code (the je of Dnm) of every stencil bit, for each parity of the target box
+void FmmSystem::setStencilOffsetCode() {
+  int parity,bit;
+  vec3<int> boxIndex3D;
+
+  for( parity=0; parity<8; parity++ ) {
+    for( bit=0; bit<numStencilBits; bit++ ) {
+      boxIndex3D.x = 5+parity/4-bit/36;
+      boxIndex3D.y = 5+parity/2%2-bit/6%6;
+      boxIndex3D.z = 5+parity%2-bit%6;
+      morton1(boxIndex3D,stencilOffsetCode[parity][bit],3);
+    }
+  }
+}
+
+// Expand the interaction list of box ii at numLevel, from the explicit list when one is set or else from its mask,
+// along with the relative offset code of each source when code is given
+void FmmSystem::getInteractionListOfBox(int ii, int numLevel, int* list, int* code) {
+  int i,bit,ij,boxIndex,ix0,iy0,iz0,parity;
+  unsigned int word;
+  vec3<int> boxIndex3D;
+
+  if( interactionOffset != NULL ) {
+    for( ij=0; ij<numInteraction[ii]; ij++ ) list[ij] = interactionSource[interactionOffset[ii]+ij];
+    if( code != NULL ) {
+      for( ij=0; ij<numInteraction[ii]; ij++ ) code[ij] = interactionSourceCode[interactionOffset[ii]+ij];
+    }
+    return;
+  }
+  boxIndex3D = boxIndex3DFull[ii+levelOffset[numLevel-1]];
+  parity = (boxIndex3D.x%2)*4+(boxIndex3D.y%2)*2+boxIndex3D.z%2;
+  ix0 = 2*((boxIndex3D.x+2)/2)-4;
+  iy0 = 2*((boxIndex3D.y+2)/2)-4;
+  iz0 = 2*((boxIndex3D.z+2)/2)-4;
+  ij = 0;
+  for( i=0; i<numStencilWords; i++ ) {
+    word = interactionMask[ii][i];
+    while( word != 0 ) {
+      bit = 32*i+__builtin_ctz(word);
+      word &= word-1;
+      boxIndex3D.x = ix0+bit/36;
+      boxIndex3D.y = iy0+bit/6%6;
+      boxIndex3D.z = iz0+bit%6;
+      morton1(boxIndex3D,boxIndex,numLevel);
+      list[ij] = boxIndexMask[boxIndex];
+      if( code != NULL ) code[ij] = stencilOffsetCode[parity][bit];
+      ij++;
+    }
+  }
+}
+
+// Number of boxes per level, after the upward pass
+void FmmSystem::getNumBoxLevel(int* numBoxLevel) {
+  int numLevel;
+
+  for( numLevel=2; numLevel<=maxLevel; numLevel++ ) {
+    if( numLevel == 2 ) {
+      numBoxLevel[numLevel] = numBoxIndexTotal-levelOffset[1];
+    } else {
+      numBoxLevel[numLevel] = levelOffset[numLevel-2]-levelOffset[numLevel-1];
+    }
+  }
+}
+
+// Barnes-Hut traversal of the source tree for each leaf, accepting a source box for M2P when
+// its radius plus the leaf radius is below openingAngle times their distance, and opening it otherwise
+// Both radii grow by the displacement within the Verlet skin
+void FmmSystem::traverseOpeningAngle(FmmKernel& kernel) {
+  int i,ii,jj,jb,numLevel,numKind,kind,pass,round,roundSize,numActive,sp;
+  int *numBoxLevel,**listOffset,**listCount,*listData,*roundOffset,(*stack)[2];
+  vec3<float> boxCenterTarget,boxCenterSource;
+  float boxSize,radiusTarget,radiusSource,distance;
+
+// Kinds 0..maxLevel-2 are M2P from level kind+2, kind maxLevel-1 is P2P between leaves
+  numKind = maxLevel;
+  numBoxLevel = new int [maxLevel+1];
+  getNumBoxLevel(numBoxLevel);
+
+  listOffset = new int* [numKind];
+  listCount = new int* [numKind];
+  for( kind=0; kind<numKind; kind++ ) {
+    listOffset[kind] = new int [numBoxIndexLeaf+1];
+    listCount[kind] = new int [numBoxIndexLeaf];
+  }
+  stack = new int [numBoxLevel[2]+8*maxLevel][2];
+  roundOffset = new int [numBoxIndexLeaf];
+  listData = NULL;
+
+// The first pass counts the lists and the second pass fills them
+  for( pass=0; pass<2; pass++ ) {
+    for( ii=0; ii<numBoxIndexLeaf; ii++ ) {
+      for( kind=0; kind<numKind; kind++ ) listCount[kind][ii] = 0;
+      boxSize = rootBoxSize/(1 << maxLevel);
+      boxCenterTarget = boxCenterFull[ii];
+      radiusTarget = boxSize*sqrt(3.0)/2+maxDisplacement;
+      sp = 0;
+      for( jj=numBoxLevel[2]-1; jj>=0; jj-- ) {
+        stack[sp][0] = 2;
+        stack[sp][1] = jj;
+        sp++;
+      }
+      while( sp > 0 ) {
+        sp--;
+        numLevel = stack[sp][0];
+        jj = stack[sp][1];
+        jb = jj+levelOffset[numLevel-1];
+        boxSize = rootBoxSize/(1 << numLevel);
+        boxCenterSource = boxCenterFull[jb];
+        radiusSource = boxSize*sqrt(3.0)/2+maxDisplacement;
+        distance = sqrt((boxCenterTarget.x-boxCenterSource.x)*(boxCenterTarget.x-boxCenterSource.x)+
+                        (boxCenterTarget.y-boxCenterSource.y)*(boxCenterTarget.y-boxCenterSource.y)+
+                        (boxCenterTarget.z-boxCenterSource.z)*(boxCenterTarget.z-boxCenterSource.z));
+        if( radiusTarget+radiusSource < openingAngle*distance ) {
+          kind = numLevel-2;
+        } else if( numLevel == maxLevel ) {
+          kind = maxLevel-1;
+        } else {
+          for( i=boxChildEnd[jb]-1; i>=boxChildStart[jb]; i-- ) {
+            stack[sp][0] = numLevel+1;
+            stack[sp][1] = i;
+            sp++;
+          }
+          continue;
+        }
+        if( pass == 1 ) listData[listOffset[kind][ii]+listCount[kind][ii]] = jj;
+        listCount[kind][ii]++;
+      }
+    }
+    if( pass == 0 ) {
+      i = 0;
+      for( kind=0; kind<numKind; kind++ ) {
+        for( ii=0; ii<numBoxIndexLeaf; ii++ ) {
+          listOffset[kind][ii] = i;
+          i += listCount[kind][ii];
+        }
+        listOffset[kind][numBoxIndexLeaf] = i;
+      }
+      listData = new int [i];
+    }
+  }
+
+// Feed the lists to the kernels in rounds of at most numP2PInteraction or maxM2LInteraction sources per leaf
+  for( kind=0; kind<numKind; kind++ ) {
+    roundSize = kind == maxLevel-1 ? numP2PInteraction : maxM2LInteraction;
+    for( round=0; ; round+=roundSize ) {
+      numActive = 0;
+      for( ii=0; ii<numBoxIndexLeaf; ii++ ) {
+        numInteraction[ii] = std::max(0,std::min(listCount[kind][ii]-round,roundSize));
+        roundOffset[ii] = listOffset[kind][ii]+round;
+        if( numInteraction[ii] > 0 ) numActive++;
+      }
+      interactionOffset = roundOffset;
+      interactionSource = listData;
+      interactionSourceCode = NULL;
+      if( numActive == 0 ) break;
+      if( kind == maxLevel-1 ) {
+        log_time(7);
+        evaluateP2P(kernel,numBoxIndexLeaf);
+        log_time(0);
+      } else {
+        log_time(7);
+        kernel.m2p(numBoxIndexLeaf,kind+2);
+        log_time(3);
+      }
+    }
+  }
+
+  for( kind=0; kind<numKind; kind++ ) {
+    delete[] listOffset[kind];
+    delete[] listCount[kind];
+  }
+  delete[] listOffset;
+  delete[] listCount;
+  delete[] listData;
+  delete[] roundOffset;
+  delete[] stack;
+  interactionOffset = NULL;
+  delete[] numBoxLevel;
+}
+
+// Dual tree traversal over pairs of boxes of the same level, emitting both directions of each pair into
+// per-level M2L queues and a leaf P2P queue. A pair is accepted for M2L when it is not adjacent, or when it is
+// adjacent but the particle radii of the two boxes add up to at most half their distance. This is tighter than
+// the sqrt(3)/2 of the worst non-adjacent pair, since pairs at that bound are rare in the stencil but common here.
+// The sources of a box are children of its parent's neighbours, so its M2L queue holds up to 215 of them
+// Within the Verlet skin the non-adjacent leaf pairs must also stay below that bound, so drifted particles go
+// to P2P. Otherwise leaves go to P2P and other pairs are split into child pairs. Only neighbours are split,
+// since the children of boxes two apart could be up to five apart, beyond the +-3 of the relative codes
+void FmmSystem::traverseDualTree() {
+  int i,ia,ib,ja,jb,ic,jc,numLevel,numKind,kind,pass,sp,dir,target,source,level,index;
+  int *numBoxLevel,**queueCount,(*stack)[3];
+  vec3<int> boxIndexA,boxIndexB,boxIndex3D;
+  vec3<float> boxCenter,childCenter;
+  float boxSize,distance,*radius;
+
+// Kinds 0..maxLevel-2 are M2L at level kind+2, kind maxLevel-1 is P2P between leaves
+  numKind = maxLevel;
+  numBoxLevel = new int [maxLevel+1];
+  getNumBoxLevel(numBoxLevel);
+
+// Radius of the particles around the box center, from the leaves up
+  radius = new float [numBoxIndexTotal];
+  for( ia=0; ia<numBoxIndexLeaf; ia++ ) {
+    boxCenter = boxCenterFull[ia];
+    radius[ia] = 0;
+    for( i=particleOffset[0][ia]; i<=particleOffset[1][ia]; i++ ) {
+      radius[ia] = std::max(radius[ia],sqrtf((bodyPos[i].x-boxCenter.x)*(bodyPos[i].x-boxCenter.x)+
+                                             (bodyPos[i].y-boxCenter.y)*(bodyPos[i].y-boxCenter.y)+
+                                             (bodyPos[i].z-boxCenter.z)*(bodyPos[i].z-boxCenter.z)));
+    }
+  }
+  for( numLevel=maxLevel-1; numLevel>=2; numLevel-- ) {
+    for( ia=0; ia<numBoxLevel[numLevel]; ia++ ) {
+      ib = ia+levelOffset[numLevel-1];
+      boxCenter = boxCenterFull[ib];
+      radius[ib] = 0;
+      for( ic=boxChildStart[ib]; ic<boxChildEnd[ib]; ic++ ) {
+        jc = ic+levelOffset[numLevel];
+        childCenter = boxCenterFull[jc];
+        radius[ib] = std::max(radius[ib],radius[jc]+sqrtf((childCenter.x-boxCenter.x)*(childCenter.x-boxCenter.x)+
+                                                          (childCenter.y-boxCenter.y)*(childCenter.y-boxCenter.y)+
+                                                          (childCenter.z-boxCenter.z)*(childCenter.z-boxCenter.z)));
+      }
+    }
+  }
+
+  interactionQueueOffset = new int* [numKind];
+  queueCount = new int* [numKind];
+  for( kind=0; kind<numKind; kind++ ) {
+    level = std::min(kind+2,maxLevel);
+    interactionQueueOffset[kind] = new int [numBoxLevel[level]+1];
+    queueCount[kind] = new int [numBoxLevel[level]];
+  }
+  stack = new int [numBoxLevel[2]*(numBoxLevel[2]+1)/2+64*maxLevel][3];
+  interactionQueue = NULL;
+
+// The first pass counts the queues and the second pass fills them
+  for( pass=0; pass<2; pass++ ) {
+    for( kind=0; kind<numKind; kind++ ) {
+      level = std::min(kind+2,maxLevel);
+      for( ia=0; ia<numBoxLevel[level]; ia++ ) queueCount[kind][ia] = 0;
+    }
+    sp = 0;
+    for( ia=0; ia<numBoxLevel[2]; ia++ ) {
+      for( ja=ia; ja<numBoxLevel[2]; ja++ ) {
+        stack[sp][0] = 2;
+        stack[sp][1] = ia;
+        stack[sp][2] = ja;
+        sp++;
+      }
+    }
+    while( sp > 0 ) {
+      sp--;
+      numLevel = stack[sp][0];
+      ia = stack[sp][1];
+      ja = stack[sp][2];
+      ib = ia+levelOffset[numLevel-1];
+      jb = ja+levelOffset[numLevel-1];
+      boxIndexA = boxIndex3DFull[ib];
+      boxIndexB = boxIndex3DFull[jb];
+      boxIndexB.x = abs(boxIndexA.x-boxIndexB.x);
+      boxIndexB.y = abs(boxIndexA.y-boxIndexB.y);
+      boxIndexB.z = abs(boxIndexA.z-boxIndexB.z);
+      boxSize = rootBoxSize/(1 << numLevel);
+      distance = boxSize*sqrtf(float(boxIndexB.x*boxIndexB.x+boxIndexB.y*boxIndexB.y+boxIndexB.z*boxIndexB.z));
+      if( (std::max(boxIndexB.x,std::max(boxIndexB.y,boxIndexB.z)) >= 2 &&
+           (maxDisplacement == 0 || numLevel < maxLevel || radius[ib]+radius[jb] <= 0.5f*sqrtf(3.0f)*distance)) ||
+          (ia != ja && radius[ib]+radius[jb] <= 0.5f*distance) ) {
+        kind = numLevel-2;
+      } else if( numLevel == maxLevel ) {
+        kind = maxLevel-1;
+      } else {
+        for( ic=boxChildStart[ib]; ic<boxChildEnd[ib]; ic++ ) {
+          for( jc=(ia == ja ? ic : boxChildStart[jb]); jc<boxChildEnd[jb]; jc++ ) {
+            stack[sp][0] = numLevel+1;
+            stack[sp][1] = ic;
+            stack[sp][2] = jc;
+            sp++;
+          }
+        }
+        continue;
+      }
+      for( dir=0; dir<2; dir++ ) {
+        if( dir == 1 && ia == ja ) break;
+        target = dir == 0 ? ia : ja;
+        source = dir == 0 ? ja : ia;
+        if( pass == 1 ) {
+          index = interactionQueueOffset[kind][target]+queueCount[kind][target];
+          interactionQueue[index] = source;
+          boxIndexA = boxIndex3DFull[target+levelOffset[numLevel-1]];
+          boxIndexB = boxIndex3DFull[source+levelOffset[numLevel-1]];
+          boxIndex3D.x = boxIndexA.x-boxIndexB.x+3;
+          boxIndex3D.y = boxIndexA.y-boxIndexB.y+3;
+          boxIndex3D.z = boxIndexA.z-boxIndexB.z+3;
+          morton1(boxIndex3D,interactionQueueCode[index],3);
+        }
+        queueCount[kind][target]++;
+      }
+    }
+    if( pass == 0 ) {
+      i = 0;
+      for( kind=0; kind<numKind; kind++ ) {
+        level = std::min(kind+2,maxLevel);
+        for( ia=0; ia<numBoxLevel[level]; ia++ ) {
+          interactionQueueOffset[kind][ia] = i;
+          i += queueCount[kind][ia];
+        }
+        interactionQueueOffset[kind][numBoxLevel[level]] = i;
+      }
+      interactionQueue = new int [i];
+      interactionQueueCode = new int [i];
+    }
+  }
+
+  for( kind=0; kind<numKind; kind++ ) delete[] queueCount[kind];
+  delete[] queueCount;
+  delete[] stack;
+  delete[] radius;
+  delete[] numBoxLevel;
+}
+
+// Point the kernels at one dual tree queue
+void FmmSystem::getInteractionListFromQueue(int numBoxIndex, int kind) {
+  int ii;
+
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    numInteraction[ii] = interactionQueueOffset[kind][ii+1]-interactionQueueOffset[kind][ii];
+  }
+  interactionOffset = interactionQueueOffset[kind];
+  interactionSource = interactionQueue;
+  interactionSourceCode = interactionQueueCode;
+}
+
 // Main part of the FMM/treecode
 void FmmSystem::fmmMain(int numParticles, int treeOrFMM){
-  int i,numLevel,numBoxIndex,numBoxIndexOld;
+  int i,k;
+  float *bodyWeight,*potential;
+  double fmmTic;
   FmmKernel kernel;
   log_time(0);
   for( i=0; i<9; i++ ) t[i] = 0;
+  fmmTic = get_time();
+
+// Direct summation below the crossover, predicted from the measured cost per pair of the direct summation
+// and per particle of the last FMM call, both measured again when the thread count changes
+// The FMM cost is only trusted up to twice the size it was measured at, since setup dominates small calls,
+// and every directRecheck calls that took direct summation the FMM runs again to measure it afresh
+// Several weight vectors always take the FMM, which shares its setup between them
+  if( directFallback && !bodyWeights ) {
+    if( calibratedThreads != omp_get_max_threads() ) {
+      calibratedThreads = omp_get_max_threads();
+      directCost = 0;
+      fmmCost = 0;
+    }
+    if( directCost == 0 ) {
+      i = std::min(numParticles,directSample);
+      kernel.direct(i);
+      directCost = (get_time()-fmmTic)/i/i;
+      fmmTic = get_time();
+    }
+    if( fmmCost > 0 && numParticles <= 2*fmmCostSize && directCost*numParticles < fmmCost &&
+        directCalls < directRecheck ) {
+      directCalls++;
+      kernel.direct(numParticles);
+      directCost = (get_time()-fmmTic)/numParticles/numParticles;
+      log_time(0);
+      return;
+    }
+  }
 
   mortonIndex = new int [numParticles];
   sortValue  = new int [numParticles];
   sortIndex  = new int [numParticles];
   sortValueBuffer  = new int [numParticles];
-  sortIndexBuffer  = new int [numParticles];
 
-  setDomainSize(numParticles);
+  checkVerletSkin(numParticles,treeOrFMM);
+// P2P spans the 5x5x5 leaves only while particles drift within the Verlet skin, see getInteractionList
+  numP2PInteraction = maxDisplacement > 0 ? maxP2PInteractionSkin : maxP2PInteraction;
+
+  if( !treeReused ) setDomainSize(numParticles);
 
   setOptimumLevel(numParticles);
 
+// The counting sort needs one bucket per leaf, which can exceed numParticles for thin particle sets
+  sortIndexBuffer  = new int [std::max(numParticles,numBoxIndexFull)];
+
   log_time(7);
   sortParticles(numParticles);
   log_time(6);
 
-  countNonEmptyBoxes(numParticles);
+// Positions at the tree build, for the displacement check of the next calls
+  if( keepSorted && verletSkin > 0 && !treeReused ) {
+    delete[] bodyPosBuild;
+    bodyPosBuild = new vec3<float> [numParticles];
+    for( i=0; i<numParticles; i++ ) {
+      bodyPosBuild[i].x = bodyPos[i].x;
+      bodyPosBuild[i].y = bodyPos[i].y;
+      bodyPosBuild[i].z = bodyPos[i].z;
+    }
+  }
+
+// The box counts of the previous call still hold when no particle changed its key
+  if( numMovedParticles > 0 ) countNonEmptyBoxes(numParticles);
+
+  numVectors = bodyWeights && kernel.multiVector() ? numWeightVectors : 1;
 
   allocate();
 
+  setStencilOffsetCode();
+
+  kernel.precalc();
+
+// Several weight vectors share one pass of the kernels, with numVectors expansions per box applied to the
+// same operators. Kernels that take one expansion per box run the far field once per vector instead, with its
+// weights in bodyPos.w, while the P2P of all vectors is done together in the first pass
+// The results go to sortedAccelMulti, bodyAccel is zeroed and bodyPotential is not filled
+  potential = bodyPotential;
+  if( bodyWeights ) {
+    bodyPotential = NULL;
+    sortedWeights = new float [numParticles*numWeightVectors];
+    sortedAccelMulti = new vec3<float> [numParticles*numWeightVectors];
+    for( i=0; i<numParticles; i++ ) {
+      for( k=0; k<numWeightVectors; k++ ) {
+        sortedWeights[i*numWeightVectors+k] = bodyWeights[k*numParticles+permutation[i]];
+        sortedAccelMulti[i*numWeightVectors+k].x = 0;
+        sortedAccelMulti[i*numWeightVectors+k].y = 0;
+        sortedAccelMulti[i*numWeightVectors+k].z = 0;
+      }
+    }
+  }
+
+  if( bodyWeights && !kernel.multiVector() ) {
+    bodyWeight = new float [numParticles];
+    for( i=0; i<numParticles; i++ ) bodyWeight[i] = bodyPos[i].w;
+    for( weightVector=0; weightVector<numWeightVectors; weightVector++ ) {
+      for( i=0; i<numParticles; i++ ) bodyPos[i].w = sortedWeights[i*numWeightVectors+weightVector];
+      evaluateKernels(kernel,numParticles,treeOrFMM);
+      for( i=0; i<numParticles; i++ ) {
+        sortedAccelMulti[i*numWeightVectors+weightVector].x += bodyAccel[i].x;
+        sortedAccelMulti[i*numWeightVectors+weightVector].y += bodyAccel[i].y;
+        sortedAccelMulti[i*numWeightVectors+weightVector].z += bodyAccel[i].z;
+      }
+    }
+    weightVector = 0;
+    for( i=0; i<numParticles; i++ ) {
+      bodyPos[i].w = bodyWeight[i];
+      bodyAccel[i].x = 0;
+      bodyAccel[i].y = 0;
+      bodyAccel[i].z = 0;
+    }
+    delete[] bodyWeight;
+  } else {
+    evaluateKernels(kernel,numParticles,treeOrFMM);
+  }
+
+  if( bodyWeights ) {
+    for( i=0; i<numParticles; i++ ) {
+      for( k=0; k<numWeightVectors; k++ ) {
+        bodyAccelMulti[k*numParticles+(keepSorted ? i : permutation[i])] = sortedAccelMulti[i*numWeightVectors+k];
+      }
+    }
+    delete[] sortedWeights;
+    delete[] sortedAccelMulti;
+    bodyPotential = potential;
+  }
+
+  unsortParticles(numParticles);
+
+  deallocate();
+  log_time(7);
+  if( !bodyWeights ) {
+    fmmCost = (get_time()-fmmTic)/numParticles;
+    fmmCostSize = numParticles;
+    directCalls = 0;
+  }
+}
+
+// P2P into bodyAccel, or with bodyWeights into sortedAccelMulti for all weight vectors in the first pass
+void FmmSystem::evaluateP2P(FmmKernel& kernel, int numBoxIndex) {
+  if( !bodyWeights ) {
+    kernel.p2p(numBoxIndex);
+  } else if( weightVector == 0 ) {
+    kernel.p2pMulti(numBoxIndex,numWeightVectors,sortedWeights,sortedAccelMulti);
+  }
+}
+
+// Kernels from P2P to L2P on the particles sorted by fmmMain, starting from the leaf box table
+void FmmSystem::evaluateKernels(FmmKernel& kernel, int numParticles, int treeOrFMM) {
+  int i,numLevel,numBoxIndex,numBoxIndexOld;
+
   numLevel = maxLevel;
 
   levelOffset[numLevel-1] = 0;
 
-  kernel.precalc();
-
   getBoxData(numParticles,numBoxIndex);
 
 // P2P
 
-  getInteractionList(numBoxIndex,numLevel,0);
-
   for( i=0; i<numParticles; i++ ) {
     bodyAccel[i].x = 0;
     bodyAccel[i].y = 0;
     bodyAccel[i].z = 0;
   }
+  if( bodyPotential ) {
+    for( i=0; i<numParticles; i++ ) bodyPotential[i] = 0;
+  }
 
-  log_time(7);
-  kernel.p2p(numBoxIndex);
-  log_time(0);
+  if( treeOrFMM < 2 ) {
+
+    getInteractionList(numBoxIndex,numLevel,0);
+
+    log_time(7);
+    evaluateP2P(kernel,numBoxIndex);
+    log_time(0);
+
+  }
 
   numLevel = maxLevel;
 
@@ -538,7 +1283,13 @@ void FmmSystem::fmmMain(int numParticles, int treeOrFMM){
 
   }
 
-  if( treeOrFMM == 0 ) {
+  if( treeOrFMM == 2 ) {
+
+// M2P and P2P from the opening angle traversal
+
+    traverseOpeningAngle(kernel);
+
+  } else if( treeOrFMM == 0 ) {
 
 // M2P at level 2
 
@@ -550,9 +1301,27 @@ void FmmSystem::fmmMain(int numParticles, int treeOrFMM){
 
   } else {
 
+    if( treeOrFMM == 3 ) {
+
+// M2L and P2P queues from the dual tree traversal, then P2P
+
+      traverseDualTree();
+
+      getInteractionListFromQueue(numBoxIndexLeaf,maxLevel-1);
+
+      log_time(7);
+      evaluateP2P(kernel,numBoxIndexLeaf);
+      log_time(0);
+
+    }
+
 // M2L at level 2
 
-    getInteractionList(numBoxIndex,numLevel,1);
+    if( treeOrFMM == 3 ) {
+      getInteractionListFromQueue(numBoxIndex,0);
+    } else {
+      getInteractionList(numBoxIndex,numLevel,1);
+    }
 
     log_time(7);
     kernel.m2l(numBoxIndex,numLevel);
@@ -575,7 +1344,11 @@ void FmmSystem::fmmMain(int numParticles, int treeOrFMM){
 
 // M2L at lower levels
 
-        getInteractionList(numBoxIndex,numLevel,2);
+        if( treeOrFMM == 3 ) {
+          getInteractionListFromQueue(numBoxIndex,numLevel-2);
+        } else {
+          getInteractionList(numBoxIndex,numLevel,2);
+        }
 
         log_time(7);
         kernel.m2l(numBoxIndex,numLevel);
@@ -595,8 +1368,76 @@ void FmmSystem::fmmMain(int numParticles, int treeOrFMM){
 
   }
 
-  unsortParticles(numParticles);
+  if( treeOrFMM == 3 ) {
+    for( i=0; i<maxLevel; i++ ) delete[] interactionQueueOffset[i];
+    delete[] interactionQueueOffset;
+    delete[] interactionQueue;
+    delete[] interactionQueueCode;
+    interactionOffset = NULL;
+  }
+}
 
-  deallocate();
-  log_time(7);
+// Advance a 64-bit linear congruential state and return its upper 32 bits, so that sampledError draws its
+// targets from its own seed without touching the stream of rand()
+inline unsigned int nextRandom(unsigned long long& state) {
+  state = state*6364136223846793005ULL+1442695040888963407ULL;
+  return (unsigned int) (state >> 32);
+}
+
+// Relative L2 error of bodyAccel against direct summation at numSamples random targets, O(numSamples*N).
+// The same seed draws the same targets. errorLow/errorHigh bound the error by the percentiles of the mean
+// squared relative error over errorBootstrap resamples of the targets, which stay finite for any sample
+double FmmSystem::sampledError(int numParticles, int numSamples, int seed, double& errorLow, double& errorHigh) {
+  int i,j,k,b,*sampleIndex;
+  unsigned long long state;
+  double dx,dy,dz,invDist,invDistCube,difference,normalizer,mean,*sampleError,*bootstrapMean;
+  vec3<double> ai;
+  sampleIndex = new int [numSamples];
+  sampleError = new double [numSamples];
+  state = seed;
+  nextRandom(state);
+  for( k=0; k<numSamples; k++ ) {
+    sampleIndex[k] = (unsigned long long) nextRandom(state)*numParticles >> 32;
+  }
+#pragma omp parallel for private(i,j,dx,dy,dz,invDist,invDistCube,difference,normalizer,ai)
+  for( k=0; k<numSamples; k++ ) {
+    i = sampleIndex[k];
+    ai.x = ai.y = ai.z = 0;
+    for( j=0; j<numParticles; j++ ) {
+      dx = bodyPos[i].x-bodyPos[j].x;
+      dy = bodyPos[i].y-bodyPos[j].y;
+      dz = bodyPos[i].z-bodyPos[j].z;
+      invDist = 1.0/sqrt(dx*dx+dy*dy+dz*dz+eps);
+      invDistCube = bodyPos[j].w*invDist*invDist*invDist;
+      ai.x -= dx*invDistCube;
+      ai.y -= dy*invDistCube;
+      ai.z -= dz*invDistCube;
+    }
+    ai.x *= inv4PI;
+    ai.y *= inv4PI;
+    ai.z *= inv4PI;
+    difference = (bodyAccel[i].x-ai.x)*(bodyAccel[i].x-ai.x)+
+                 (bodyAccel[i].y-ai.y)*(bodyAccel[i].y-ai.y)+
+                 (bodyAccel[i].z-ai.z)*(bodyAccel[i].z-ai.z);
+    normalizer = ai.x*ai.x+ai.y*ai.y+ai.z*ai.z;
+    sampleError[k] = difference/normalizer;
+  }
+  mean = 0;
+  for( k=0; k<numSamples; k++ ) mean += sampleError[k]/numSamples;
+
+// Resample the targets with replacement from the same generator, and take the central errorCoverage of the means
+  bootstrapMean = new double [errorBootstrap];
+  for( b=0; b<errorBootstrap; b++ ) {
+    bootstrapMean[b] = 0;
+    for( k=0; k<numSamples; k++ ) {
+      bootstrapMean[b] += sampleError[(unsigned long long) nextRandom(state)*numSamples >> 32]/numSamples;
+    }
+  }
+  std::sort(bootstrapMean,bootstrapMean+errorBootstrap);
+  errorLow = sqrt(bootstrapMean[int((1-errorCoverage)/2*(errorBootstrap-1))]);
+  errorHigh = sqrt(bootstrapMean[int((1+errorCoverage)/2*(errorBootstrap-1)+0.5)]);
+  delete[] bootstrapMean;
+  delete[] sampleIndex;
+  delete[] sampleError;
+  return sqrt(mean);
 }
@@ -33,8 +33,39 @@ public:
 
 #ifdef MAIN
 vec3<float> *bodyAccel;
+float *bodyPotential;                            // potential of each particle when set, filled along with bodyAccel
+float *bodyWeights;                              // numWeightVectors weights per particle when set, vector after vector
+vec3<float> *bodyAccelMulti;                     // acceleration from each vector of bodyWeights, laid out the same way
+int numWeightVectors;                            // number of weight vectors evaluated on one tree by fmmMain
+int numVectors = 1;                              // expansions per box, numWeightVectors while fmmMain runs bodyWeights
+int weightVector;                                // vector of the current pass when the kernels take one expansion per box
+float *sortedWeights;                            // bodyWeights in tree order, numWeightVectors per particle
+vec3<float> *sortedAccelMulti;                   // bodyAccelMulti in tree order, numWeightVectors per particle
 vec4<float> *bodyPos;
+vec3<float> *bodyVel;                            // velocity, permuted along with bodyPos when keepSorted is set
+int *bodyIndex;                                  // particle ID, permuted along with bodyPos when keepSorted is set
+int keepSorted;                                  // 1 : particles stay in tree order after fmmMain, no unsort
+int *bodyKey;                                    // leaf of each particle in the previous call, kept when keepSorted is set
+int numBodyKey;                                  // length of bodyKey
+int numMovedParticles;                           // particles whose key changed since the previous call
+float verletSkin;                                // leaf widths a particle may move before the tree is rebuilt, 0 : off
+vec3<float> *bodyPosBuild;                       // positions at the last tree build, in tree order
+float maxDisplacement;                           // largest displacement since the last tree build
+int treeReused;                                  // 1 : this call reuses the leaves of the previous call
+int numP2PInteraction = maxP2PInteraction;       // max of P2P interacting boxes in this call, sizes the P2P lists
+int numTreeBuild;                                // calls that built the tree while verletSkin is set
+int numTreeReuse;                                // calls that reused the tree while verletSkin is set
 int maxLevel;                                    // number of FMM levels
+int translationType;                             // 0 : rotation O(p^3), 1 : direct O(p^4) M2L on CPU
+float openingAngle = 0.8;                        // Barnes-Hut acceptance for treeOrFMM == 2
+int directFallback;                              // 1 : fmmMain uses direct summation below the measured crossover
+double directCost;                               // measured time per pair of the direct summation
+double fmmCost;                                  // measured time per particle of the last FMM call
+int fmmCostSize;                                 // numParticles of the last FMM call
+int directCalls;                                 // calls that took direct summation since fmmCost was measured
+int calibratedThreads;                           // thread count directCost and fmmCost were measured with
+int directDouble = 1;                            // 1 : direct summation in double, 0 : float summed in double per tile
+int curveType;                                   // 0 : Morton, 1 : Hilbert order of particles and boxes
 int numBoxIndexFull;                             // full list of FMM boxes @ maxLevel
 int numBoxIndexLeaf;                             // just the non-empty FMM boxes @ maxLevel
 int numBoxIndexTotal;                            // total of numBoxIndexLeaf for all levels
@@ -42,10 +73,22 @@ int *permutation;                                // permutation key used for sor
 int **particleOffset;                            // first and last particle in each box
 int *boxIndexMask;                               // link list for box index : Full -> NonEmpty
 int *boxIndexFull;                               // link list for box index : NonEmpty -> Full
+vec3<int> *boxIndex3DFull;                       // 3D box index of each non-empty box, laid out like boxIndexFull
+vec3<float> *boxCenterFull;                      // center of each non-empty box, laid out like boxIndexFull
+int *boxParent;                                  // parent of each non-empty box, -1 at level 2
+int *boxChildStart;                              // first child of each non-empty box, as index within its level
+int *boxChildEnd;                                // one past the last child of each non-empty box
 int *levelOffset;                                // offset of box index for each level
 int *mortonIndex;                                // Morton index of each particle
 int *numInteraction;                             // size of interaction list
-int (*interactionList)[maxM2LInteraction];       // non-empty interaction list for P2P and M2L
+unsigned int (*interactionMask)[numStencilWords]; // P2P/M2L/M2P stencil lists as bits over the parent's neighbours
+int *interactionOffset;                          // start of each box in interactionSource, NULL for the masks
+int *interactionSource;                          // explicit interaction list from the tree traversals
+int *interactionSourceCode;                      // relative offset codes of interactionSource, NULL if not kept
+int stencilOffsetCode[8][numStencilBits];        // relative offset code of each stencil bit, per parity of the target
+int **interactionQueueOffset;                    // offset of each box in the dual tree queues, per kind
+int *interactionQueue;                           // source boxes of the dual tree queues
+int *interactionQueueCode;                       // relative offset codes of the dual tree queues
 int *boxOffsetStart;                             // offset of box index for GPU buffer
 int *boxOffsetEnd;                               // offset of box index for GPU buffer
 int *sortValue;                                  // temporary array used for Counting Sort
@@ -55,6 +98,10 @@ int *sortIndexBuffer;                            // temporary array used for Cou
 float rootBoxSize;                               // length of FMM domain
 float *factorial;                                // factorial(n) = n!
 vec3<float> boxMin;                              // axis limit of entire FMM domain
+vec3<float> boxExtent;                           // extent of the particles along each axis
+float planarTolerance = 1e-6;                    // z extent relative to the x,y extent below which the system is planar
+int planarSystem;                                // 1 : particles lie in the plane z = planeHeight, boxes centered in it
+float planeHeight;                               // z of the particles of a planar system
 std::complex<double> (*Lnm)[numCoefficients];    // local expansion coefficients
 std::complex<double> (*LnmOld)[numCoefficients]; // Lnm from previous level
 std::complex<double> (*Mnm)[numCoefficients];    // multipole expansion coefficnets
@@ -78,8 +125,39 @@ void log_time(int stage) {                       // event timer
 }
 #else
 extern vec3<float> *bodyAccel;
+extern float *bodyPotential;
+extern float *bodyWeights;
+extern vec3<float> *bodyAccelMulti;
+extern int numWeightVectors;
+extern int numVectors;
+extern int weightVector;
+extern float *sortedWeights;
+extern vec3<float> *sortedAccelMulti;
 extern vec4<float> *bodyPos;
+extern vec3<float> *bodyVel;
+extern int *bodyIndex;
+extern int keepSorted;
+extern int *bodyKey;
+extern int numBodyKey;
+extern int numMovedParticles;
+extern float verletSkin;
+extern vec3<float> *bodyPosBuild;
+extern float maxDisplacement;
+extern int treeReused;
+extern int numP2PInteraction;
+extern int numTreeBuild;
+extern int numTreeReuse;
 extern int maxLevel;
+extern int translationType;
+extern float openingAngle;
+extern int directFallback;
+extern double directCost;
+extern double fmmCost;
+extern int fmmCostSize;
+extern int directCalls;
+extern int calibratedThreads;
+extern int directDouble;
+extern int curveType;
 extern int numBoxIndexFull;
 extern int numBoxIndexLeaf;
 extern int numBoxIndexTotal;
@@ -87,10 +165,22 @@ extern int *permutation;
 extern int **particleOffset;
 extern int *boxIndexMask;
 extern int *boxIndexFull;
+extern vec3<int> *boxIndex3DFull;
+extern vec3<float> *boxCenterFull;
+extern int *boxParent;
+extern int *boxChildStart;
+extern int *boxChildEnd;
 extern int *levelOffset;
 extern int *mortonIndex;
 extern int *numInteraction;
-extern int (*interactionList)[maxM2LInteraction];
+extern unsigned int (*interactionMask)[numStencilWords];
+extern int *interactionOffset;
+extern int *interactionSource;
+extern int *interactionSourceCode;
+extern int stencilOffsetCode[8][numStencilBits];
+extern int **interactionQueueOffset;
+extern int *interactionQueue;
+extern int *interactionQueueCode;
 extern int *boxOffsetStart;
 extern int *boxOffsetEnd;
 extern int *sortValue;
@@ -100,11 +190,15 @@ extern int *sortIndexBuffer;
 extern float rootBoxSize;
 extern float *factorial;
 extern vec3<float> boxMin;
+extern vec3<float> boxExtent;
+extern float planarTolerance;
+extern int planarSystem;
+extern float planeHeight;
 extern std::complex<double> (*Lnm)[numCoefficients];
 extern std::complex<double> (*LnmOld)[numCoefficients];
 extern std::complex<double> (*Mnm)[numCoefficients],*Ynm,***Dnm;
 extern double tic,t[9];
-extern void get_time(int);
+extern double get_time(void);
 extern void log_time(int);
 #endif
 
@@ -113,9 +207,11 @@ class FmmSystem
 public:
   void allocate();
   void deallocate();
+  void checkVerletSkin(int numParticles, int treeOrFMM);
   void setDomainSize(int numParticles);
   void setOptimumLevel(int numParticles);
   void morton(int numParticles);
+  void hilbert(int numParticles);
   void morton1(vec3<int> boxIndex3D, int& boxIndex, int numLevel);
   void unmorton(int boxIndex, vec3<int>& boxIndex3D);
   void sort(int numParticles);
@@ -126,7 +222,16 @@ public:
   void getBoxDataOfParent(int& numBoxIndex, int numLevel, int treeOrFMM);
   void getBoxIndexMask(int numBoxIndex, int numLevel);
   void getInteractionList(int numBoxIndex, int numLevel, int interactionType);
+  void setStencilOffsetCode();
+  void getInteractionListOfBox(int ii, int numLevel, int* list, int* code=NULL);
+  void getNumBoxLevel(int* numBoxLevel);
+  void traverseOpeningAngle(FmmKernel& kernel);
+  void traverseDualTree();
+  void getInteractionListFromQueue(int numBoxIndex, int kind);
+  void evaluateP2P(FmmKernel& kernel, int numBoxIndex);
+  void evaluateKernels(FmmKernel& kernel, int numParticles, int treeOrFMM);
   void fmmMain(int numParticles, int treeOrFMM);
+  double sampledError(int numParticles, int numSamples, int seed, double& errorLow, double& errorHigh);
 };
 
 #endif // __FMM_H__
@@ -13,7 +13,7 @@ unsigned int hostDnmSize;
 unsigned int hostConstantSize;
 
 int *hostOffset;
-float3 *hostAccel;
+float4 *hostAccel;
 float3 *hostPosTarget;
 float4 *hostPosSource;
 float *hostMnmTarget;
@@ -37,7 +37,7 @@ static unsigned int deviceYnmSize=0;
 static unsigned int deviceDnmSize=0;
 
 static int *deviceOffset;
-static float3 *deviceAccel;
+static float4 *deviceAccel;
 static float3 *devicePosTarget;
 static float4 *devicePosSource;
 static float *deviceMnmTarget;
@@ -78,6 +78,9 @@ void FmmKernel::direct(int n) {
     bodyAccel[i].y = 0;
     bodyAccel[i].z = 0;
   }
+  if( bodyPotential ) {
+    for( i=0; i<n; i++ ) bodyPotential[i] = 0;
+  }
   nicall = n/targetBufferSize+1;
   njcall = n/sourceBufferSize+1;
   iblok = (n/nicall+threadsPerBlockTypeA-1)/threadsPerBlockTypeA;
@@ -85,12 +88,12 @@ void FmmKernel::direct(int n) {
   hostOffsetSize=sizeof(int)*iblok*offsetStride;
   hostPosTargetSize=sizeof(float3)*targetBufferSize;
   hostPosSourceSize=sizeof(float4)*sourceBufferSize;
-  hostAccelSize=sizeof(float3)*targetBufferSize;
+  hostAccelSize=sizeof(float4)*targetBufferSize;
 
   hostOffset=(int *)malloc(hostOffsetSize);
   hostPosTarget=(float3 *)malloc(hostPosTargetSize);
   hostPosSource=(float4 *)malloc(hostPosSourceSize);
-  hostAccel=(float3 *)malloc(hostAccelSize);
+  hostAccel=(float4 *)malloc(hostAccelSize);
 
   if (is_set==0) {
     CUDA_SAFE_CALL(cudaSetDevice(0));
@@ -178,7 +181,7 @@ void FmmKernel::direct(int n) {
 
       dim3 block(threadsPerBlockTypeA);
       dim3 grid(iblok);
-      p2p_kernel<<< grid, block >>>(deviceOffset,devicePosTarget,devicePosSource,deviceAccel);
+      p2p_kernel<<< grid, block >>>(deviceOffset,offsetStride,devicePosTarget,devicePosSource,deviceAccel);
       cudaCheckError();
       nflop = 19;
 
@@ -197,6 +200,7 @@ void FmmKernel::direct(int n) {
           bodyAccel[ibase+is+i].x += inv4PI*hostAccel[im].x;
           bodyAccel[ibase+is+i].y += inv4PI*hostAccel[im].y;
           bodyAccel[ibase+is+i].z += inv4PI*hostAccel[im].z;
+          if( bodyPotential ) bodyPotential[ibase+is+i] += inv4PI*hostAccel[im].w;
         }
         iblok++;
       }
@@ -228,6 +232,14 @@ void FmmKernel::precalc() {
   double Dnmd[numExpansion4];
   double fnma,fnpa,pn,p,p1,p2,anmd,anmkd,xijc,yijc,zijc,rho,alpha,beta,sc,ank,ek;
   std::complex<double> expBeta[numExpansion2],eim(0,1),cnm;
+  static int planarNotice = 0;
+
+// The GPU kernels place the box centers in 3D and translate every coefficient, so planar systems are solved in 3D
+  if( planarSystem ) {
+    if( !planarNotice ) printf("planarSystem is not supported by the GPU kernels, solving in 3D\n");
+    planarNotice = 1;
+    planarSystem = 0;
+  }
 
   for( n=0; n<2*numExpansions; n++ ) {
     for( m=-n; m<=n; m++ ) {
@@ -412,25 +424,30 @@ void FmmKernel::precalc() {
 void FmmKernel::p2p(int numBoxIndex) {
   int nicall,jc,jj,ii,njd,ij,icall,jcall,iblok,im,jjd,j,ibase,isize,is,i,ijc,jjdd;
   int ni,nj,nflop,*jbase,*jsize,*njcall,*njj,**interactionListOffsetStart,**interactionListOffsetEnd;
-  const int offsetStride = 2*maxP2PInteraction+1;
+  const int offsetStride = 2*numP2PInteraction+1;
+  int *interactionList;
   double tic,toc,flops,t[10],op=0;
 
+// The buffer offsets below are built from fixed-width lists, so the masks are expanded here
+  interactionList = new int [numBoxIndex*numP2PInteraction];
+  for( ii=0; ii<numBoxIndex; ii++ ) tree.getInteractionListOfBox(ii,maxLevel,interactionList+ii*numP2PInteraction);
+
   for(i=0;i<10;i++) t[i]=0;
   tic=get_gpu_time();
 
   hostOffsetSize=sizeof(int)*targetBufferSize/threadsPerBlockTypeA*offsetStride;
   hostPosTargetSize=sizeof(float3)*targetBufferSize;
   hostPosSourceSize=sizeof(float4)*sourceBufferSize;
-  hostAccelSize=sizeof(float3)*targetBufferSize;
+  hostAccelSize=sizeof(float4)*targetBufferSize;
 
   hostOffset=(int *)malloc(hostOffsetSize);
   hostPosTarget=(float3 *)malloc(hostPosTargetSize);
   hostPosSource=(float4 *)malloc(hostPosSourceSize);
-  hostAccel=(float3 *)malloc(hostAccelSize);
-  interactionListOffsetStart = new int* [maxM2LInteraction];
-  for( i=0; i<maxM2LInteraction; i++ ) interactionListOffsetStart[i] = new int [numBoxIndexLeaf];
-  interactionListOffsetEnd = new int* [maxM2LInteraction];
-  for( i=0; i<maxM2LInteraction; i++ ) interactionListOffsetEnd[i] = new int [numBoxIndexLeaf];
+  hostAccel=(float4 *)malloc(hostAccelSize);
+  interactionListOffsetStart = new int* [numP2PInteraction];
+  for( i=0; i<numP2PInteraction; i++ ) interactionListOffsetStart[i] = new int [numBoxIndexLeaf];
+  interactionListOffsetEnd = new int* [numP2PInteraction];
+  for( i=0; i<numP2PInteraction; i++ ) interactionListOffsetEnd[i] = new int [numBoxIndexLeaf];
   jbase = new int [numBoxIndexLeaf];
   jsize = new int [numBoxIndexLeaf];
   njcall = new int [numBoxIndexLeaf];
@@ -479,7 +496,7 @@ void FmmKernel::p2p(int numBoxIndex) {
       jc = 0;
       interactionListOffsetStart[0][ii] = 0;
       for( ij=0; ij<numInteraction[ii]; ij++ ) {
-        jj = interactionList[ii][ij];
+        jj = interactionList[ii*numP2PInteraction+ij];
         if( njj[jj] == 0 ) {
           nj += particleOffset[1][jj]-particleOffset[0][jj]+1;
           njj[jj] = 1;
@@ -525,7 +542,7 @@ void FmmKernel::p2p(int numBoxIndex) {
             *threadsPerBlockTypeA;
         nj = 0;
         for( ij=0; ij<numInteraction[ii]; ij++ ) {
-          jj = interactionList[ii][ij];
+          jj = interactionList[ii*numP2PInteraction+ij];
           nj += particleOffset[1][jj]-particleOffset[0][jj]+1;
           njj[jj] = 1;
         }
@@ -545,7 +562,7 @@ void FmmKernel::p2p(int numBoxIndex) {
       for( ii=boxOffsetStart[icall]; ii<=boxOffsetEnd[icall]; ii++ ) {
         if( numInteraction[ii] != 0 ) {
           for( ij=interactionListOffsetStart[jcall][ii]; ij<=interactionListOffsetEnd[jcall][ii]; ij++ ) {
-            jj = interactionList[ii][ij];
+            jj = interactionList[ii*numP2PInteraction+ij];
             if( njj[jj] == 0 ) {
               jbase[jjd] = jc;
               for( j=particleOffset[0][jj]; j<=particleOffset[1][jj]; j++ ) {
@@ -574,7 +591,7 @@ void FmmKernel::p2p(int numBoxIndex) {
                                             -interactionListOffsetStart[jcall][ii]+1;
             ijc = 0;
             for( ij=interactionListOffsetStart[jcall][ii]; ij<=interactionListOffsetEnd[jcall][ii]; ij++ ) {
-              jj = interactionList[ii][ij];
+              jj = interactionList[ii*numP2PInteraction+ij];
               if( njj[jj] != 0 ) {
                 jjdd = njj[jj]-1;
                 hostOffset[iblok*offsetStride+2*ijc+1] = jbase[jjdd];
@@ -601,7 +618,7 @@ void FmmKernel::p2p(int numBoxIndex) {
 
         dim3 block(threadsPerBlockTypeA);
         dim3 grid(iblok);
-        p2p_kernel<<< grid, block >>>(deviceOffset,devicePosTarget,devicePosSource,deviceAccel);
+        p2p_kernel<<< grid, block >>>(deviceOffset,offsetStride,devicePosTarget,devicePosSource,deviceAccel);
         cudaCheckError();
         nflop = 19;
 
@@ -625,6 +642,7 @@ void FmmKernel::p2p(int numBoxIndex) {
               bodyAccel[ibase+is+i].x += inv4PI*hostAccel[im].x;
               bodyAccel[ibase+is+i].y += inv4PI*hostAccel[im].y;
               bodyAccel[ibase+is+i].z += inv4PI*hostAccel[im].z;
+              if( bodyPotential ) bodyPotential[ibase+is+i] += inv4PI*hostAccel[im].w;
             }
             iblok++;
           }
@@ -636,9 +654,9 @@ void FmmKernel::p2p(int numBoxIndex) {
   free(hostPosTarget);
   free(hostPosSource);
   free(hostAccel);
-  for( i=0; i<maxM2LInteraction; i++ ) delete[] interactionListOffsetStart[i];
+  for( i=0; i<numP2PInteraction; i++ ) delete[] interactionListOffsetStart[i];
   delete[] interactionListOffsetStart;
-  for( i=0; i<maxM2LInteraction; i++ ) delete[] interactionListOffsetEnd[i];
+  for( i=0; i<numP2PInteraction; i++ ) delete[] interactionListOffsetEnd[i];
   delete[] interactionListOffsetEnd;
   delete[] jbase;
   delete[] jsize;
@@ -656,6 +674,47 @@ void FmmKernel::p2p(int numBoxIndex) {
 //  printf("p2p other      : %f s\n",t[0]);
 //  printf("p2p flops      : %f G\n",flops/1e9);
   tic=flops;
+  delete[] interactionList;
+}
+
+// p2m to l2p take one expansion per box, so fmmMain runs them once per weight vector
+int FmmKernel::multiVector() {
+  return 0;
+}
+
+// p2p of several weight vectors, one p2p per vector with its weights swapped into bodyPos
+// weights and accels hold numVectors values per particle in tree order, bodyAccel is left as it was
+void FmmKernel::p2pMulti(int numBoxIndex, int numVectors, float* weights, vec3<float>* accels) {
+  int i,k,numParticles;
+  float *weight;
+  vec3<float> *accel;
+  numParticles = particleOffset[1][numBoxIndex-1]+1;
+  weight = new float [numParticles];
+  accel = new vec3<float> [numParticles];
+  for( i=0; i<numParticles; i++ ) {
+    weight[i] = bodyPos[i].w;
+    accel[i] = bodyAccel[i];
+  }
+  for( k=0; k<numVectors; k++ ) {
+    for( i=0; i<numParticles; i++ ) {
+      bodyPos[i].w = weights[i*numVectors+k];
+      bodyAccel[i].x = 0;
+      bodyAccel[i].y = 0;
+      bodyAccel[i].z = 0;
+    }
+    p2p(numBoxIndex);
+    for( i=0; i<numParticles; i++ ) {
+      accels[i*numVectors+k].x += bodyAccel[i].x;
+      accels[i*numVectors+k].y += bodyAccel[i].y;
+      accels[i*numVectors+k].z += bodyAccel[i].z;
+    }
+  }
+  for( i=0; i<numParticles; i++ ) {
+    bodyPos[i].w = weight[i];
+    bodyAccel[i] = accel[i];
+  }
+  delete[] weight;
+  delete[] accel;
 }
 
 // p2m
@@ -801,7 +860,7 @@ void FmmKernel::p2m(int numBoxIndex) {
 // m2m
 void FmmKernel::m2m(int numBoxIndex, int numBoxIndexOld, int numLevel) {
   int n,m,npm,nmm,je,k,nmk,ii,ib,j,ncall,jj,icall;
-  int iblok,jc,nfic,jb,jbase,jsize,nfip,jm;
+  int iblok,jc,nfic,jb,jbase,jsize,jm;
   int i,nj,nk,nflop;
   vec3<int> boxIndex3D;
   const int offsetStride = 3;
@@ -965,8 +1024,7 @@ void FmmKernel::m2m(int numBoxIndex, int numBoxIndexOld, int numLevel) {
     iblok = 0;
     for( jj=boxOffsetStart[icall]; jj<=boxOffsetEnd[icall]; jj++ ) {
       jb = jj+levelOffset[numLevel];
-      nfip = boxIndexFull[jb]/8;
-      ib = boxIndexMask[nfip]+levelOffset[numLevel-1];
+      ib = boxParent[jb];
       for( j=0; j<numCoefficients; j++ ) {
         jm = iblok*threadsPerBlockTypeB+j;
         Mnm[ib][j] += std::complex<double>(hostMnmTarget[2*jm+0],hostMnmTarget[2*jm+1]);
@@ -997,15 +1055,22 @@ void FmmKernel::m2m(int numBoxIndex, int numBoxIndexOld, int numLevel) {
 
 // m2l
 void FmmKernel::m2l(int numBoxIndex, int numLevel) {
-  int i,j,m,n,npm,nmm,je,k,nmk,ncall,jj,ii,ib,ij,icall,iblok,jc,jjd;
-  int jb,jbd,ix,iy,iz,is,jjdd,jx,jy,jz,isize,im;
+  int i,j,m,n,npm,nmm,je,k,nmk,ncall,jj,ii,ij,icall,iblok,jc,jjd;
+  int jb,is,jjdd,isize,im;
   int ni,nj,nk,nflop,*jbase,*jsize,*njj;
-  vec3<int> boxIndex3D;
   const int offsetStride = 2*maxM2LInteraction+1;
+  int (*interactionList)[maxM2LInteraction],(*interactionCode)[maxM2LInteraction];
   double tic,toc,flops,t[10],boxSize,op=0;
   for(i=0;i<10;i++) t[i]=0;
   tic=get_gpu_time();
 
+// The buffer offsets below are built from fixed-width lists, so the masks are expanded here
+  interactionList = new int [numBoxIndex][maxM2LInteraction];
+  interactionCode = new int [numBoxIndex][maxM2LInteraction];
+  for( ii=0; ii<numBoxIndex; ii++ ) {
+    tree.getInteractionListOfBox(ii,numLevel,interactionList[ii],interactionCode[ii]);
+  }
+
   boxSize = rootBoxSize/(1 << numLevel);
 
   hostConstantSize=sizeof(float)*4;
@@ -1151,26 +1216,13 @@ void FmmKernel::m2l(int numBoxIndex, int numLevel) {
           njj[jj] = jjd;
         }
       }
-      ib = ii+levelOffset[numLevel-1];
-      tree.unmorton(boxIndexFull[ib],boxIndex3D);
-      ix = boxIndex3D.x;
-      iy = boxIndex3D.y;
-      iz = boxIndex3D.z;
       isize = numCoefficients;
       for( is=0; is<isize; is+=threadsPerBlockTypeB ) {
         hostOffset[iblok*offsetStride] = numInteraction[ii];
         for( ij=0; ij<numInteraction[ii]; ij++ ) {
           jj = interactionList[ii][ij];
-          jbd = jj+levelOffset[numLevel-1];
           jjdd = njj[jj]-1;
-          tree.unmorton(boxIndexFull[jbd],boxIndex3D);
-          jx = boxIndex3D.x;
-          jy = boxIndex3D.y;
-          jz = boxIndex3D.z;
-          boxIndex3D.x = (ix-jx)+3;
-          boxIndex3D.y = (iy-jy)+3;
-          boxIndex3D.z = (iz-jz)+3;
-          tree.morton1(boxIndex3D,je,3);
+          je = interactionCode[ii][ij];
           hostOffset[iblok*offsetStride+2*ij+1] = jbase[jjdd];
           hostOffset[iblok*offsetStride+2*ij+2] = je+1;
           op += (double) threadsPerBlockTypeB*jsize[jjdd];
@@ -1245,12 +1297,14 @@ void FmmKernel::m2l(int numBoxIndex, int numLevel) {
 //  printf("m2l other      : %f s\n",t[0]);
 //  printf("m2l flops      : %f G\n",flops/1e9);
   tic=flops;
+  delete[] interactionList;
+  delete[] interactionCode;
 }
 
 // l2l
 void FmmKernel::l2l(int numBoxIndex, int numLevel) {
   int m,n,npm,nmm,je,k,nmk,numBoxIndexOld,ii,i;
-  int ncall,icall,iblok,ic,nfip,nfic,ib,jbase,jsize,im;
+  int ncall,icall,iblok,ic,nfic,ib,jbase,jsize,im;
   int ni,nk,nflop;
   vec3<int> boxIndex3D;
   const int offsetStride = 3;
@@ -1338,19 +1392,6 @@ void FmmKernel::l2l(int numBoxIndex, int numLevel) {
     }
   }
 
-  int nbc,neo[numBoxIndexFull];
-  nbc = -1;
-  numBoxIndexOld = 0;
-  for( i=0; i<numBoxIndexFull; i++ ) neo[i] = -1;
-  for( ii=0; ii<numBoxIndex; ii++ ) {
-    ib = ii+levelOffset[numLevel-1];
-    if( nbc != boxIndexFull[ib]/8 ) {
-      nbc = boxIndexFull[ib]/8;
-      neo[nbc] = numBoxIndexOld;
-      numBoxIndexOld++;
-    }
-  }
-
   numBoxIndexOld = numBoxIndex;
   if( numBoxIndexOld < 8 ) numBoxIndexOld = 8;
   for( ii=0; ii<numBoxIndexOld; ii++ ) {
@@ -1379,14 +1420,13 @@ void FmmKernel::l2l(int numBoxIndex, int numLevel) {
     ic = 0;
     for( ii=boxOffsetStart[icall]; ii<=boxOffsetEnd[icall]; ii++ ) {
       ib = ii+levelOffset[numLevel-1];
-      nfip = boxIndexFull[ib]/8;
       nfic = boxIndexFull[ib]%8;
       tree.unmorton(nfic,boxIndex3D);
       boxIndex3D.x = boxIndex3D.x*2+2;
       boxIndex3D.y = boxIndex3D.y*2+2;
       boxIndex3D.z = boxIndex3D.z*2+2;
       tree.morton1(boxIndex3D,je,3);
-      ib = neo[nfip];
+      ib = boxParent[ib]-levelOffset[numLevel-2];
       jbase = ic;
       for( i=0; i<numCoefficients; i++ ) {
         hostLnmSource[2*ic+0] = std::real(LnmOld[ib][i]);
@@ -1473,13 +1513,13 @@ void FmmKernel::l2p(int numBoxIndex) {
   hostOffsetSize=sizeof(int)*targetBufferSize/threadsPerBlockTypeB*offsetStride;
   hostPosTargetSize=sizeof(float3)*targetBufferSize;
   hostLnmSourceSize=sizeof(float)*2*sourceBufferSize;
-  hostAccelSize=sizeof(float3)*targetBufferSize;
+  hostAccelSize=sizeof(float4)*targetBufferSize;
 
   hostConstant=(float *)malloc(hostConstantSize);
   hostOffset=(int *)malloc(hostOffsetSize);
   hostPosTarget=(float3 *)malloc(hostPosTargetSize);
   hostLnmSource=(float *)malloc(hostLnmSourceSize);
-  hostAccel=(float3 *)malloc(hostAccelSize);
+  hostAccel=(float4 *)malloc(hostAccelSize);
 
   hostConstant[0]=(float) boxSize;
   hostConstant[1]=(float) boxMin.x;
@@ -1561,7 +1601,7 @@ void FmmKernel::l2p(int numBoxIndex) {
           hostPosTarget[im].y = 0;
           hostPosTarget[im].z = 0;
         }
-        tree.unmorton(boxIndexFull[ii],boxIndex3D);
+        boxIndex3D = boxIndex3DFull[ii];
         hostOffset[iblok*offsetStride] = jbase;
         hostOffset[iblok*offsetStride+1] = jsize;
         hostOffset[iblok*offsetStride+2] = boxIndex3D.x;
@@ -1607,6 +1647,7 @@ void FmmKernel::l2p(int numBoxIndex) {
           bodyAccel[ibase+is+i].x += inv4PI*hostAccel[im].x;
           bodyAccel[ibase+is+i].y += inv4PI*hostAccel[im].y;
           bodyAccel[ibase+is+i].z += inv4PI*hostAccel[im].z;
+          if( bodyPotential ) bodyPotential[ibase+is+i] += inv4PI*hostAccel[im].w;
         }
         iblok++;
       }
@@ -1638,8 +1679,13 @@ void FmmKernel::m2p(int numBoxIndex, int numLevel) {
   int ni,nj,nflop,*jbase,*jsize,*njcall,*njj,**interactionListOffsetStart,**interactionListOffsetEnd;
   vec3<int> boxIndex3D;
   const int offsetStride = 4*maxM2LInteraction+1;
+  int (*interactionList)[maxM2LInteraction];
   double tic,toc,flops,t[10],boxSize,op=0;
 
+// The buffer offsets below are built from fixed-width lists, so the masks are expanded here
+  interactionList = new int [numBoxIndex][maxM2LInteraction];
+  for( ii=0; ii<numBoxIndex; ii++ ) tree.getInteractionListOfBox(ii,numLevel,interactionList[ii]);
+
   for(i=0;i<10;i++) t[i]=0;
   tic=get_gpu_time();
 
@@ -1649,13 +1695,13 @@ void FmmKernel::m2p(int numBoxIndex, int numLevel) {
   hostOffsetSize=sizeof(int)*targetBufferSize/threadsPerBlockTypeB*offsetStride;
   hostPosTargetSize=sizeof(float3)*targetBufferSize;
   hostMnmSourceSize=sizeof(float)*2*sourceBufferSize;
-  hostAccelSize=sizeof(float3)*targetBufferSize;
+  hostAccelSize=sizeof(float4)*targetBufferSize;
 
   hostConstant=(float *)malloc(hostConstantSize);
   hostOffset=(int *)malloc(hostOffsetSize);
   hostPosTarget=(float3 *)malloc(hostPosTargetSize);
   hostMnmSource=(float *)malloc(hostMnmSourceSize);
-  hostAccel=(float3 *)malloc(hostAccelSize);
+  hostAccel=(float4 *)malloc(hostAccelSize);
 
   interactionListOffsetStart = new int* [maxM2LInteraction];
   for( i=0; i<maxM2LInteraction; i++ ) interactionListOffsetStart[i] = new int [numBoxIndexLeaf];
@@ -1816,7 +1862,7 @@ void FmmKernel::m2p(int numBoxIndex, int numLevel) {
               jb = jj+levelOffset[numLevel-1];
               if( njj[jj] != 0 ) {
                 jjdd = njj[jj]-1;
-                tree.unmorton(boxIndexFull[jb],boxIndex3D);
+                boxIndex3D = boxIndex3DFull[jb];
                 hostOffset[iblok*offsetStride+4*ijc+1] = jbase[jjdd];
                 hostOffset[iblok*offsetStride+4*ijc+2] = boxIndex3D.x;
                 hostOffset[iblok*offsetStride+4*ijc+3] = boxIndex3D.y;
@@ -1869,6 +1915,7 @@ void FmmKernel::m2p(int numBoxIndex, int numLevel) {
               bodyAccel[ibase+is+i].x += inv4PI*hostAccel[im].x;
               bodyAccel[ibase+is+i].y += inv4PI*hostAccel[im].y;
               bodyAccel[ibase+is+i].z += inv4PI*hostAccel[im].z;
+              if( bodyPotential ) bodyPotential[ibase+is+i] += inv4PI*hostAccel[im].w;
             }
             iblok++;
           }
@@ -1900,4 +1947,5 @@ void FmmKernel::m2p(int numBoxIndex, int numLevel) {
 //  printf("m2p other      : %f s\n",t[0]);
 //  printf("m2p flops      : %f G\n",flops/1e9);
   tic=flops;
+  delete[] interactionList;
 }
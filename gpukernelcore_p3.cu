@@ -18,29 +18,31 @@ __device__ void cart2sph(float& r, float& theta, float& phi, float dx, float dy,
   }
 }
 
-__device__ float3 p2p_kernel_core(float3 ai, float3 bi, float4 bj)
+// The potential goes to ai.w, skipping pairs at zero distance to leave the particle itself out
+__device__ float4 p2p_kernel_core(float4 ai, float3 bi, float4 bj)
 {
   float3 dist;
   dist.x = bi.x - bj.x;
   dist.y = bi.y - bj.y;
   dist.z = bi.z - bj.z;
-  float invDist = rsqrtf(dist.x*dist.x+dist.y*dist.y+dist.z*dist.z+eps);
+  float distSquare = dist.x*dist.x+dist.y*dist.y+dist.z*dist.z;
+  float invDist = distSquare > 0 ? rsqrtf(distSquare+eps) : 0;
   float invDistCube = invDist*invDist*invDist;
   float s = bj.w*invDistCube;
   ai.x -= dist.x * s;
   ai.y -= dist.y * s;
   ai.z -= dist.z * s;
+  ai.w += bj.w * invDist;
   return ai;
 }
 
-__global__ void p2p_kernel(int *deviceOffset,float3 *devicePosTarget,float4 *devicePosSource,float3 *deviceAccel)
+__global__ void p2p_kernel(int *deviceOffset,int offsetStride,float3 *devicePosTarget,float4 *devicePosSource,float4 *deviceAccel)
 {
   int jbase,jsize,jblok,numInteraction;
   int j,ij,jj;
   const int threadsPerBlock=threadsPerBlockTypeA;
-  const int offsetStride=2*maxP2PInteraction+1;
   float3 posTarget;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   __shared__ float4 sharedPosSource[threadsPerBlock];
   posTarget=devicePosTarget[blockIdx.x*threadsPerBlock+threadIdx.x];
   numInteraction=deviceOffset[blockIdx.x*offsetStride];
@@ -614,7 +616,7 @@ __global__ void l2l_kernel(int *deviceOffset,float *deviceLnmTarget,float *devic
   for(i=0;i<2;i++) deviceLnmTarget[2*(blockIdx.x*threadsPerBlock+threadIdx.x)+i]=LnmTarget[i];
 }
 
-__global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *deviceLnmSource,float3 *deviceAccel)
+__global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *deviceLnmSource,float4 *deviceAccel)
 {
   int i,m,n,jbase,nms;
   const int threadsPerBlock=threadsPerBlockTypeB;
@@ -626,7 +628,7 @@ __global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
   float xx,yy,s2,p,pn,p1,p2,fact,ere,eim,rhom,rhon,realj,imagj;
   float accelR,accelTheta,accelPhi;
   float anm,YnmReal,YnmRealTheta;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   __shared__ float sharedLnmSource[2*threadsPerBlock];
   __shared__ float sharedFactorial[2*numExpansions];
   fact=1.0;
@@ -668,6 +670,7 @@ __global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
     realj=ere*sharedLnmSource[2*nms+0]-eim*sharedLnmSource[2*nms+1];
     imagj=eim*sharedLnmSource[2*nms+0]+ere*sharedLnmSource[2*nms+1];
     accelR+=2*m/r*YnmReal*realj;
+    accel.w+=2*YnmReal*realj;
     accelTheta+=2*YnmRealTheta*realj;
     accelPhi-=2*m*YnmReal*imagj;
     rhom*=r;
@@ -683,6 +686,7 @@ __global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
       realj=ere*sharedLnmSource[2*nms+0]-eim*sharedLnmSource[2*nms+1];
       imagj=eim*sharedLnmSource[2*nms+0]+ere*sharedLnmSource[2*nms+1];
       accelR+=2*n/r*YnmReal*realj;
+      accel.w+=2*YnmReal*realj;
       accelTheta+=2*YnmRealTheta*realj;
       accelPhi-=2*m*YnmReal*imagj;
       rhon*=r;
@@ -696,7 +700,7 @@ __global__ void l2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
   deviceAccel[blockIdx.x*threadsPerBlock+threadIdx.x]=accel;
 }
 
-__global__ void m2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *deviceMnmSource,float3 *deviceAccel)
+__global__ void m2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *deviceMnmSource,float4 *deviceAccel)
 {
   int i,m,n,jx,jy,jz,ij,numInteraction,jbase,nms;
   const int threadsPerBlock=threadsPerBlockTypeB;
@@ -708,7 +712,7 @@ __global__ void m2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
   float xx,yy,s2,p,pn,p1,p2,fact,ere,eim,realj,imagj;
   float accelR,accelTheta,accelPhi;
   float anm,YnmReal,YnmRealTheta;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   float3 posTarget;
   __shared__ float sharedMnmSource[2*threadsPerBlock];
   __shared__ float sharedFactorial[2*numExpansions];
@@ -758,6 +762,7 @@ __global__ void m2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
       realj=ere*sharedMnmSource[2*nms+0]-eim*sharedMnmSource[2*nms+1];
       imagj=eim*sharedMnmSource[2*nms+0]+ere*sharedMnmSource[2*nms+1];
       accelR-=2*(m+1)/r*YnmReal*realj;
+      accel.w+=2*YnmReal*realj;
       accelTheta+=2*YnmRealTheta*realj;
       accelPhi-=2*m*YnmReal*imagj;
       rhom/=r;
@@ -773,6 +778,7 @@ __global__ void m2p_kernel(int *deviceOffset,float3 *devicePosTarget,float *devi
         realj=ere*sharedMnmSource[2*nms+0]-eim*sharedMnmSource[2*nms+1];
         imagj=eim*sharedMnmSource[2*nms+0]+ere*sharedMnmSource[2*nms+1];
         accelR-=2*(n+1)/r*YnmReal*realj;
+        accel.w+=2*YnmReal*realj;
         accelTheta+=2*YnmRealTheta*realj;
         accelPhi-=2*m*YnmReal*imagj;
         rhon/=r;
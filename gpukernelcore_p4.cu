@@ -18,31 +18,33 @@ __device__ void cart2sph(float& r, float& theta, float& phi, float dx, float dy,
   }
 }
 
-__device__ float3 p2p_kernel_core(float3 accel,
+// The potential goes to accel.w, skipping pairs at zero distance to leave the particle itself out
+__device__ float4 p2p_kernel_core(float4 accel,
                                   float3 posTarget, float4 sharedPosSource)
 {
   float3 dist;
   dist.x = posTarget.x - sharedPosSource.x;
   dist.y = posTarget.y - sharedPosSource.y;
   dist.z = posTarget.z - sharedPosSource.z;
-  float invDist = rsqrtf(dist.x * dist.x + dist.y * dist.y + dist.z * dist.z + eps);
+  float distSquare = dist.x * dist.x + dist.y * dist.y + dist.z * dist.z;
+  float invDist = distSquare > 0 ? rsqrtf(distSquare + eps) : 0;
   float invDistCube = invDist * invDist * invDist;
   float s = sharedPosSource.w * invDistCube;
   accel.x  -=  dist.x * s;
   accel.y  -=  dist.y * s;
   accel.z  -=  dist.z * s;
+  accel.w  +=  sharedPosSource.w * invDist;
   return accel;
 }
 
-__global__ void p2p_kernel(int* deviceOffset, float3* devicePosTarget,
-                           float4* devicePosSource, float3* deviceAccel)
+__global__ void p2p_kernel(int* deviceOffset, int offsetStride, float3* devicePosTarget,
+                           float4* devicePosSource, float4* deviceAccel)
 {
   int jbase, jsize, jblok, numInteraction;
   int j, ij, jj, jb;
   const int threadsPerBlock = threadsPerBlockTypeA;
-  const int offsetStride = 2 * maxP2PInteraction + 1;
   float3 posTarget;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   __shared__ float4 sharedPosSource[threadsPerBlock];
   posTarget = devicePosTarget[blockIdx.x * threadsPerBlock + threadIdx.x];
   numInteraction = deviceOffset[blockIdx.x * offsetStride];
@@ -563,7 +565,7 @@ __global__ void l2l_kernel(int* deviceOffset, float* deviceLnmTarget,
   for(i = 0; i < 2; i++) deviceLnmTarget[2 * ib + i] = LnmTarget[i];
 }
 
-__device__ float3 l2p_kernel_core(float3 accel,
+__device__ float4 l2p_kernel_core(float4 accel,
                                   float r, float theta, float phi,
                                   float* sharedFactorial, float* sharedLnmSource)
 {
@@ -595,6 +597,7 @@ __device__ float3 l2p_kernel_core(float3 accel,
     realj = ere*sharedLnmSource[2 * i + 0] - eim * sharedLnmSource[2 * i + 1];
     imagj = eim*sharedLnmSource[2 * i + 0] + ere * sharedLnmSource[2 * i + 1];
     accelR += 2 * m / r * Ynm * realj;
+    accel.w += 2 * Ynm * realj;
     accelTheta += 2 * YnmTheta * realj;
     accelPhi -= 2 * m * Ynm * imagj;
     rhom *= r;
@@ -610,6 +613,7 @@ __device__ float3 l2p_kernel_core(float3 accel,
       realj = ere*sharedLnmSource[2 * i + 0] - eim * sharedLnmSource[2 * i + 1];
       imagj = eim*sharedLnmSource[2 * i + 0] + ere * sharedLnmSource[2 * i + 1];
       accelR += 2 * n / r * Ynm * realj;
+      accel.w += 2 * Ynm * realj;
       accelTheta += 2 * YnmTheta * realj;
       accelPhi -= 2 * m * Ynm * imagj;
       rhon *= r;
@@ -629,7 +633,7 @@ __device__ float3 l2p_kernel_core(float3 accel,
 }
 
 __global__ void l2p_kernel(int* deviceOffset, float3* devicePosTarget,
-                           float* deviceLnmSource, float3* deviceAccel)
+                           float* deviceLnmSource, float4* deviceAccel)
 {
   int i, jbase;
   const int threadsPerBlock = threadsPerBlockTypeB;
@@ -638,7 +642,7 @@ __global__ void l2p_kernel(int* deviceOffset, float3* devicePosTarget,
   float r, theta, phi, fact;
   float3 boxMin = {deviceConstant[1], deviceConstant[2], deviceConstant[3]};
   float3 boxCenter, dist;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   __shared__ float sharedLnmSource[2 * threadsPerBlock];
   __shared__ float sharedFactorial[2 * numExpansions];
   fact = 1.0;
@@ -661,7 +665,7 @@ __global__ void l2p_kernel(int* deviceOffset, float3* devicePosTarget,
   deviceAccel[blockIdx.x * threadsPerBlock + threadIdx.x] = accel;
 }
 
-__device__ float3 m2p_kernel_core(float3 accel,
+__device__ float4 m2p_kernel_core(float4 accel,
                                   float r, float theta, float phi,
                                   float* sharedFactorial, float* sharedMnmSource)
 {
@@ -693,6 +697,7 @@ __device__ float3 m2p_kernel_core(float3 accel,
     realj = ere*sharedMnmSource[2 * i + 0] - eim * sharedMnmSource[2 * i + 1];
     imagj = eim*sharedMnmSource[2 * i + 0] + ere * sharedMnmSource[2 * i + 1];
     accelR -= 2 * (m + 1) / r * Ynm * realj;
+    accel.w += 2 * Ynm * realj;
     accelTheta += 2 * YnmTheta * realj;
     accelPhi -= 2 * m * Ynm * imagj;
     rhom /= r;
@@ -708,6 +713,7 @@ __device__ float3 m2p_kernel_core(float3 accel,
       realj = ere * sharedMnmSource[2 * i + 0] - eim * sharedMnmSource[2 * i + 1];
       imagj = eim * sharedMnmSource[2 * i + 0] + ere * sharedMnmSource[2 * i + 1];
       accelR -= 2 * (n + 1) / r * Ynm * realj;
+      accel.w += 2 * Ynm * realj;
       accelTheta += 2 * YnmTheta * realj;
       accelPhi -= 2 * m * Ynm * imagj;
       rhon /= r;
@@ -727,7 +733,7 @@ __device__ float3 m2p_kernel_core(float3 accel,
 }
 
 __global__ void m2p_kernel(int* deviceOffset, float3* devicePosTarget,
-                           float* deviceMnmSource, float3* deviceAccel)
+                           float* deviceMnmSource, float4* deviceAccel)
 {
   int i, jx, jy, jz, ij, numInteraction, jbase;
   const int threadsPerBlock = threadsPerBlockTypeB;
@@ -736,7 +742,7 @@ __global__ void m2p_kernel(int* deviceOffset, float3* devicePosTarget,
   float3 boxMin = {deviceConstant[1], deviceConstant[2], deviceConstant[3]};
   float3 boxCenter, dist;
   float r, theta, phi, fact;
-  float3 accel = {0.0f, 0.0f, 0.0f};
+  float4 accel = {0.0f, 0.0f, 0.0f, 0.0f};
   float3 posTarget;
   __shared__ float sharedMnmSource[2 * threadsPerBlock];
   __shared__ float sharedFactorial[2 * numExpansions];
@@ -3,13 +3,19 @@
 
 #include "constants.h"
 
+template<typename T> class vec3;
+
 class FmmKernel
 {
 public:
   void direct(int numParticles);
   void precalc();
   void rotation(std::complex<double>* CnmIn, std::complex<double>* CnmOut, std::complex<double>** Dnm);
+  void rotationBatch(std::complex<double> (*CnmIn)[numCoefficients], std::complex<double> (*CnmOut)[numCoefficients],
+                     std::complex<double>** Dnm, int numVectors);
   void p2p(int numBoxIndex);
+  int multiVector();
+  void p2pMulti(int numBoxIndex, int numVectors, float* weights, vec3<float>* accels);
   void p2m(int numBoxIndex);
   void m2m(int numBoxIndex, int numBoxIndexOld, int numLevel);
   void m2l(int numBoxIndex, int numLevel);
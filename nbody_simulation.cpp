@@ -1,4 +1,6 @@
+#define MAIN
 #include "fmm.h"
+#undef MAIN
 #include "nbody_renderer.h"
 #include <cmath>
 #include <random>
@@ -9,6 +11,7 @@ const int NUM_PARTICLES = 1000;
 const int NUM_FRAMES = 300;
 const double TIME_STEP = 0.01;
 const double G = 6.67430e-11; // Gravitational constant
+const bool DIRECT_FALLBACK = false; // Let fmmMain take direct summation below the measured crossover
 
 // Simulation types
 enum SimulationType {
@@ -199,14 +202,26 @@ void updateParticles(vec4<float>* bodyPos, vec3<float>* bodyVel, vec3<float>* bo
 }
 
 int main() {
-    // Allocate memory
-    vec4<float>* bodyPos = new vec4<float>[NUM_PARTICLES];
-    vec3<float>* bodyVel = new vec3<float>[NUM_PARTICLES];
-    vec3<float>* bodyAccel = new vec3<float>[NUM_PARTICLES];
+    // Allocate memory (the FMM reads the global particle arrays)
+    bodyPos = new vec4<float>[NUM_PARTICLES];
+    bodyVel = new vec3<float>[NUM_PARTICLES];
+    bodyAccel = new vec3<float>[NUM_PARTICLES];
+    bodyPotential = new float[NUM_PARTICLES];
+    bodyIndex = new int[NUM_PARTICLES];
     
     // Initialize simulation
     SimulationType simType = SPIRAL_GALAXY; // Choose simulation type
     initializeParticles(bodyPos, bodyVel, simType);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        bodyIndex[i] = i;
+    }
+    
+    // Keep the particles in tree order between frames, velocities and IDs move with them
+    keepSorted = 1;
+    // Reuse the leaves until a particle moved a tenth of a leaf width
+    verletSkin = 0.1;
+    // Direct summation below the crossover bypasses the Verlet skin, so the FMM runs unless DIRECT_FALLBACK is set
+    directFallback = DIRECT_FALLBACK;
     
     // Set up video rendering
     std::string simName;
@@ -237,6 +252,16 @@ int main() {
         // Calculate accelerations using FMM
         tree.fmmMain(NUM_PARTICLES, 1); // Use FMM
         
+        // Total energy from the potential filled by the same FMM call, the acceleration is its gradient
+        double kineticEnergy = 0, potentialEnergy = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            kineticEnergy += 0.5 * bodyPos[i].w * (bodyVel[i].x * bodyVel[i].x +
+                                                   bodyVel[i].y * bodyVel[i].y +
+                                                   bodyVel[i].z * bodyVel[i].z);
+            potentialEnergy -= 0.5 * bodyPos[i].w * bodyPotential[i];
+        }
+        std::cout << "Energy " << kineticEnergy + potentialEnergy << std::endl;
+        
         // Store current frame
         storeFrame(bodyPos, NUM_PARTICLES, frame);
         
@@ -244,6 +269,8 @@ int main() {
         updateParticles(bodyPos, bodyVel, bodyAccel);
     }
     
+    std::cout << "Tree builds " << numTreeBuild << ", reuses " << numTreeReuse << std::endl;
+    
     // Finalize video
     finalizeVideo();
     
@@ -251,6 +278,8 @@ int main() {
     delete[] bodyPos;
     delete[] bodyVel;
     delete[] bodyAccel;
+    delete[] bodyPotential;
+    delete[] bodyIndex;
     
     std::cout << "Simulation complete!" << std::endl;
     return 0;
@@ -32,6 +32,8 @@
 #define ADDPS(src, dst) asm("addps " src ","  dst);
 #define SUBPS(src, dst) asm("subps "  src "," dst);
 #define RSQRTPS(src, dst) asm("rsqrtps " src "," dst);
+#define CMPNEQPS(mem, reg) asm("cmpneqps %0, %"reg::"m"(mem));
+#define ANDPS(src, dst) asm("andps " src "," dst);
 #define MOVHLPS(src, dst) asm("movhlps " src "," dst);
 #define DEBUGPS(reg)
 
@@ -107,6 +109,8 @@ void p2p_kernel(Ipdata *ipdata, Fodata *fodata, Jpdata *jpdata, int nj){
   MOVAPS(X2, Z2);              // Z2 = X2
   for(j=0;j<nj;j++){
     RSQRTPS(R2, RINV);         // RINV = rsqrt(R2)
+    CMPNEQPS(*ipdata->eps2, R2); // R2 = R2 != eps2, false for pairs at zero distance
+    ANDPS(R2, RINV);           // RINV = 0 for pairs at zero distance
     jpdata++;
     LOADPS(*ipdata->eps2, R2); // R2 = *ipdata->eps2
     BCAST0(X2);                // X2 = *jpdata->x
@@ -3,17 +3,22 @@
 #include "nbody_renderer.h"
 #undef MAIN
 
-const int treeOrFMM = 1; // 0 : tree, 1: FMM 
+const int treeOrFMM = 1; // 0 : tree, 1: FMM, 2: Barnes-Hut tree with openingAngle, 3: FMM with dual tree traversal
 const bool RENDER_VIDEO = true; // Flag to enable/disable video rendering
 
 int main(int argc, char *argv[]){
-  int i,iteration,numParticles;
-  double tic,toc,timeDirect,timeFMM,L2norm,difference,normalizer;
+  int i,iteration,numParticles,numSamples,seed;
+  double tic,toc,timeDirect,timeFMM,L2norm,difference,normalizer,errorLow,errorHigh;
   vec3<float> *bodyAcceld;
   FmmKernel kernel;
   FmmSystem tree;
   std::fstream fid("time2.dat",std::ios::out);
 
+  if( argc > 1 ) translationType = atoi(argv[1]); // 0 : rotation, 1 : direct M2L on CPU
+  if( argc > 2 ) curveType = atoi(argv[2]); // 0 : Morton, 1 : Hilbert ordering
+  numSamples = argc > 3 ? atoi(argv[3]) : 0; // 0 : full direct comparison, >0 : sampled error at this many targets
+  seed = argc > 4 ? atoi(argv[4]) : 1; // seed of the sampled targets
+
   bodyAccel = new vec3<float>[maxParticles];
   bodyAcceld = new vec3<float>[maxParticles];
   bodyPos = new vec4<float>[maxParticles];
@@ -59,6 +64,15 @@ int main(int argc, char *argv[]){
       finalizeVideo();
     }
 
+    if( numSamples > 0 ) {
+      tic = get_time();
+      L2norm = tree.sampledError(numParticles,numSamples,seed,errorLow,errorHigh);
+      toc = get_time();
+      printf("sample : %g\n",toc-tic);
+      printf("error  : %g (bootstrap interval %g - %g)\n\n",L2norm,errorLow,errorHigh);
+      continue;
+    }
+
     tic = get_time();
     kernel.direct(numParticles);
     toc = get_time();